@@ -0,0 +1,150 @@
+#ifndef KV_SERVER_BYTE_KEY_H
+#define KV_SERVER_BYTE_KEY_H
+#include <cctype>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+#include "snapshot.h"
+
+namespace skiplist {
+
+// A byte string key ordered like memcmp. The first 8 bytes are kept next
+// to the string as a big endian integer, zero padded, so most compares in
+// a search are one integer compare that never touches the string bytes.
+// int64 keys are stored as 8 bytes in the order of the integers, see
+// from_int64, and always compare on the prefix alone.
+class ByteKey {
+public:
+    static const size_t PREFIX_SIZE = sizeof(uint64_t);
+
+    ByteKey() : _prefix(0) { }
+    explicit ByteKey(std::string bytes)
+        : _prefix(load_prefix(bytes.data(), bytes.size())), _bytes(std::move(bytes)) { }
+    ByteKey(const char* data, size_t size)
+        : _prefix(load_prefix(data, size)), _bytes(data, size) { }
+
+    // big endian with the sign bit flipped, negative numbers first
+    static ByteKey from_int64(int64_t v) {
+        uint64_t u = static_cast<uint64_t>(v) ^ (1ULL << 63);
+        char buf[PREFIX_SIZE];
+        for (size_t i = 0; i < PREFIX_SIZE; ++i) {
+            buf[i] = static_cast<char>(u >> (56 - 8 * i));
+        }
+        return ByteKey(buf, PREFIX_SIZE);
+    }
+    // only for keys made by from_int64
+    int64_t to_int64() const {
+        return static_cast<int64_t>(_prefix ^ (1ULL << 63));
+    }
+
+    // first 8 bytes as a big endian integer, zero padded
+    uint64_t prefix() const {
+        return _prefix;
+    }
+    const std::string& bytes() const {
+        return _bytes;
+    }
+    size_t size() const {
+        return _bytes.size();
+    }
+
+    bool operator<(const ByteKey& other) const {
+        if (_prefix != other._prefix) {
+            return _prefix < other._prefix;
+        }
+        // char_traits<char> compares as unsigned char, like memcmp
+        return _bytes < other._bytes;
+    }
+    bool operator==(const ByteKey& other) const {
+        return _prefix == other._prefix && _bytes == other._bytes;
+    }
+    bool operator!=(const ByteKey& other) const {
+        return !(*this == other);
+    }
+private:
+    static uint64_t load_prefix(const char* data, size_t size) {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < PREFIX_SIZE; ++i) {
+            prefix = (prefix << 8)
+                | (i < size ? static_cast<unsigned char>(data[i]) : 0);
+        }
+        return prefix;
+    }
+
+    uint64_t _prefix;
+    std::string _bytes;
+};
+
+inline size_t payload_size(const ByteKey& key) {
+    return key.size();
+}
+
+// see SkipList::find_greater_or_equal
+inline uint64_t key_prefix(const ByteKey& key) {
+    return key.prefix();
+}
+
+// printable bytes as is, the others escaped
+inline std::ostream& operator<<(std::ostream& os, const ByteKey& key) {
+    static const char HEX[] = "0123456789abcdef";
+    for (unsigned char c : key.bytes()) {
+        if (isprint(c) && c != '\\') {
+            os << c;
+        } else {
+            os << "\\x" << HEX[c >> 4] << HEX[c & 0xf];
+        }
+    }
+    return os;
+}
+
+// text dumps of older versions only hold int keys
+inline std::istream& operator>>(std::istream& is, ByteKey& key) {
+    int64_t v;
+    if (is >> v) {
+        key = ByteKey::from_int64(v);
+    }
+    return is;
+}
+
+namespace snapshot {
+
+template <>
+struct Codec<ByteKey> {
+    static void encode(const ByteKey& v, std::string* out) {
+        out->append(v.bytes());
+    }
+    static bool decode(const char* data, size_t size, ByteKey* v) {
+        *v = ByteKey(data, size);
+        return true;
+    }
+};
+
+// version 1 snapshots hold int keys
+template <>
+struct KeyDecoder<ByteKey> {
+    static bool decode(uint32_t version, const char* data, size_t size, ByteKey* key) {
+        if (version > 1) {
+            return Codec<ByteKey>::decode(data, size, key);
+        }
+        int64_t v;
+        if (!Codec<int64_t>::decode(data, size, &v)) {
+            return false;
+        }
+        *key = ByteKey::from_int64(v);
+        return true;
+    }
+};
+}
+}
+
+namespace std {
+template <>
+struct hash<skiplist::ByteKey> {
+    size_t operator()(const skiplist::ByteKey& key) const {
+        return hash<string>()(key.bytes());
+    }
+};
+}
+#endif
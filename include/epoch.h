@@ -0,0 +1,77 @@
+#ifndef KV_SERVER_EPOCH_H
+#define KV_SERVER_EPOCH_H
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include "thread_record.h"
+
+namespace ebr {
+
+// The epoch announced by one thread, on a cache line of its own.
+struct alignas(64) EpochRecord : tls::RecordBase {
+    static const uint64_t QUIESCENT = UINT64_MAX;
+
+    // epoch seen when the outermost section began, QUIESCENT outside
+    std::atomic<uint64_t> epoch{QUIESCENT};
+    // sections of the owning thread entered and not exited yet
+    int depth = 0;
+};
+
+// Epoch based reclamation. A reader announces the global epoch when it
+// enters a section and may reach any node until it exits. The writer
+// stamps an unlinked node with the epoch at retire time and frees it
+// once every active reader announced a later epoch. Readers never wait
+// and a collection costs one pass over the records, whatever the number
+// of retired nodes; a stalled reader holds back every node retired since
+// it entered. Each thread announces in its own record, nested sections
+// of a thread share the outermost announce.
+struct EpochDomain {
+    EpochDomain() : _epoch(1) {}
+
+    EpochRecord* enter() {
+        EpochRecord* r = _records.local();
+        if (r->depth++ == 0) {
+            r->epoch.store(_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+            // the announce must be visible before any node is read, pairs
+            // with the fence in advance
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        return r;
+    }
+
+    void exit(EpochRecord* r) {
+        if (--r->depth == 0) {
+            r->epoch.store(EpochRecord::QUIESCENT, std::memory_order_release);
+        }
+    }
+
+    // epoch to stamp a node unlinked now, writer only
+    uint64_t current() const {
+        return _epoch.load(std::memory_order_relaxed);
+    }
+
+    // Start a new epoch and return the oldest one a reader may still be
+    // in. Nodes stamped before it are unreachable. Writer only.
+    uint64_t advance() {
+        uint64_t oldest = _epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        _records.for_each([&oldest](EpochRecord* r) {
+            oldest = std::min(oldest, r->epoch.load(std::memory_order_acquire));
+        });
+        return oldest;
+    }
+
+    // reader records ever taken, one per thread that entered
+    size_t records() const {
+        size_t n = 0;
+        _records.for_each([&n](EpochRecord*) {
+            ++n;
+        });
+        return n;
+    }
+private:
+    std::atomic<uint64_t> _epoch;
+    tls::Registry<EpochRecord> _records;
+};
+}
+#endif
@@ -0,0 +1,167 @@
+#ifndef KV_SERVER_HASH_INDEX_H
+#define KV_SERVER_HASH_INDEX_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "reclaimer.h"
+
+namespace skiplist {
+
+// Open addressing map from key to skiplist node, next to the list for
+// point lookups. Linear probing over slots of (hash, node); a removed
+// entry leaves a tombstone that the writer reuses, so readers never see
+// entries move. One writer, lock free readers. When tombstones and live
+// entries fill 70% of the table the writer builds a new one and hands the
+// old one back to be retired like a node.
+template <typename K, typename N>
+class HashIndex {
+public:
+    struct Slot {
+        std::atomic<uint64_t> hash{0};
+        // null: never used, ends a probe
+        std::atomic<N*> node{nullptr};
+    };
+
+    struct Table {
+        explicit Table(size_t capacity) : mask(capacity - 1), slots(new Slot[capacity]) { }
+        size_t mask;
+        std::unique_ptr<Slot[]> slots;
+    };
+
+    explicit HashIndex(size_t expected_keys)
+        : _table(new Table(capacity_for(expected_keys))) { }
+    ~HashIndex() {
+        delete _table.load(std::memory_order_relaxed);
+    }
+
+    HashIndex(const HashIndex&) = delete;
+    HashIndex& operator=(const HashIndex&) = delete;
+
+    // The node holding key, protected in node_slot of guard, or null. The
+    // table is protected in table_slot while probing.
+    N* find(uint64_t hash, const K& key, reclaim::Guard<void>& guard,
+            int node_slot, int table_slot) const {
+    retry:
+        Table* table;
+        do {
+            table = _table.load(std::memory_order_acquire);
+            guard.protect(table, table_slot);
+        } while (_table.load(std::memory_order_acquire) != table);
+        for (size_t i = hash & table->mask, probes = 0; probes <= table->mask; ++probes) {
+            Slot& slot = table->slots[i];
+            N* node = slot.node.load(std::memory_order_acquire);
+            if (node == nullptr) {
+                return nullptr;
+            }
+            if (node == tombstone() || slot.hash.load(std::memory_order_relaxed) != hash) {
+                i = (i + 1) & table->mask;
+                continue;
+            }
+            // the writer erases a node from the current table before it
+            // retires it, so a node still there once published is safe
+            guard.protect(node, node_slot);
+            if (_table.load(std::memory_order_acquire) != table) {
+                goto retry;
+            }
+            if (slot.node.load(std::memory_order_acquire) != node) {
+                continue;
+            }
+            if (node->key == key) {
+                return node;
+            }
+            i = (i + 1) & table->mask;
+        }
+        return nullptr;
+    }
+
+    // Writer only, key must not be in the index. Returns the table it
+    // replaced, to be retired, or null.
+    Table* insert(uint64_t hash, N* node) {
+        Table* old = nullptr;
+        Table* table = _table.load(std::memory_order_relaxed);
+        if ((_used + 1) * 10 > (table->mask + 1) * 7) {
+            old = table;
+            table = rebuild(capacity_for(_size + 1));
+        }
+        place(table, hash, node);
+        ++_size;
+        return old;
+    }
+
+    // writer only, before node is retired
+    void erase(uint64_t hash, N* node) {
+        Table* table = _table.load(std::memory_order_relaxed);
+        for (size_t i = hash & table->mask; ; i = (i + 1) & table->mask) {
+            Slot& slot = table->slots[i];
+            N* cur = slot.node.load(std::memory_order_relaxed);
+            if (cur == nullptr) {
+                return;
+            }
+            if (cur == node) {
+                slot.node.store(tombstone(), std::memory_order_release);
+                --_size;
+                return;
+            }
+        }
+    }
+
+    size_t size() const {
+        return _size;
+    }
+    // bytes of the current table
+    size_t bytes() const {
+        return (_table.load(std::memory_order_relaxed)->mask + 1) * sizeof(Slot);
+    }
+private:
+    static N* tombstone() {
+        return reinterpret_cast<N*>(uintptr_t(1));
+    }
+
+    // half full at most, a power of 2
+    static size_t capacity_for(size_t keys) {
+        size_t n = 16;
+        while (n < keys * 2) {
+            n <<= 1;
+        }
+        return n;
+    }
+
+    // first free slot or tombstone on the probe, the key is not there
+    void place(Table* table, uint64_t hash, N* node) {
+        for (size_t i = hash & table->mask; ; i = (i + 1) & table->mask) {
+            Slot& slot = table->slots[i];
+            N* cur = slot.node.load(std::memory_order_relaxed);
+            if (cur == nullptr || cur == tombstone()) {
+                if (cur == nullptr) {
+                    ++_used;
+                }
+                slot.hash.store(hash, std::memory_order_relaxed);
+                slot.node.store(node, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+    // copy the live entries into a new table of capacity and publish it
+    Table* rebuild(size_t capacity) {
+        Table* old = _table.load(std::memory_order_relaxed);
+        Table* table = new Table(capacity);
+        _used = 0;
+        for (size_t i = 0; i <= old->mask; ++i) {
+            N* node = old->slots[i].node.load(std::memory_order_relaxed);
+            if (node != nullptr && node != tombstone()) {
+                place(table, old->slots[i].hash.load(std::memory_order_relaxed), node);
+            }
+        }
+        _table.store(table, std::memory_order_release);
+        return table;
+    }
+
+    std::atomic<Table*> _table;
+    // live entries, and slots ever used in the current table
+    size_t _size = 0;
+    size_t _used = 0;
+};
+}
+#endif
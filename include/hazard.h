@@ -1,17 +1,25 @@
 #ifndef KV_SERVER_HAZARD_H
 #define KV_SERVER_HAZARD_H
+#include <algorithm>
 #include <atomic>
+#include <cstdint>
+#include <vector>
+#include "thread_record.h"
 
 namespace hp {
 template <typename> struct HazardPointerList;
+template <typename> class HazardDomain;
+template <typename> struct HazardRecord;
 
 template <typename T>
 struct HazardPointer {
     friend struct HazardPointerList<T>;
+    friend class HazardDomain<T>;
+    friend struct HazardRecord<T>;
     
-    HazardPointer() 
+    explicit HazardPointer(bool active = true)
         : next(nullptr)
-        , is_active(ATOMIC_VAR_INIT(true))
+        , is_active(active)
         , hazardous_pointer(ATOMIC_VAR_INIT(nullptr))
     { }
     
@@ -19,6 +27,16 @@ struct HazardPointer {
         hazardous_pointer.store(ptr);
     }
 
+    // protect every pointer until release, for readers that keep several
+    // nodes across steps
+    void remember_all() {
+        hazardous_pointer.store(all());
+    }
+
+    static T* all() {
+        return reinterpret_cast<T*>(static_cast<uintptr_t>(1));
+    }
+
     void release() {
         hazardous_pointer.store(nullptr, std::memory_order_release);
         is_active.store(false, std::memory_order_release);
@@ -79,7 +97,8 @@ struct HazardPointerList {
             }
             
             auto hazardous_pointer = p->hazardous_pointer.load();
-            if (hazardous_pointer == ptr) {
+            if (hazardous_pointer == ptr
+                    || hazardous_pointer == HazardPointer<T>::all()) {
                 //hp.push_back(hazardous_pointer);
                 return true;
             }
@@ -94,8 +113,96 @@ struct HazardPointerList {
 
         return false;
     }
+
+    // append every published pointer
+    void collect(std::vector<T*>* published) {
+        for (HazardPointer<T>* p = head.load(); p; p = p->next) {
+            T* ptr = p->hazardous_pointer.load();
+            if (ptr != nullptr) {
+                published->push_back(ptr);
+            }
+        }
+    }
+
+    // pointers ever allocated, active or not
+    size_t size() const {
+        size_t n = 0;
+        for (HazardPointer<T>* p = head.load(); p; p = p->next) {
+            ++n;
+        }
+        return n;
+    }
 private:
     std::atomic<HazardPointer<T>*> head;
 };
+
+// the hazard pointers of one thread, on a cache line of their own
+template <typename T>
+struct alignas(64) HazardRecord : tls::RecordBase {
+    static const int SLOTS = 4;
+
+    HazardRecord() {
+        for (auto& slot : slots) {
+            slot.is_active.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    HazardPointer<T> slots[SLOTS];
+};
+
+// Hazard pointers handed out from a per thread record, only the owning
+// thread takes and releases them, so acquire is a few plain loads. A
+// thread holding more than SLOTS at once gets the rest from a shared
+// HazardPointerList. The writer gathers all published pointers once per
+// pass with snapshot() instead of walking every record per node.
+template <typename T>
+class HazardDomain {
+public:
+    HazardPointer<T>* acquire() {
+        HazardRecord<T>* record = _records.local();
+        for (auto& slot : record->slots) {
+            if (!slot.is_active.load(std::memory_order_relaxed)) {
+                slot.is_active.store(true, std::memory_order_relaxed);
+                return &slot;
+            }
+        }
+        return _overflow.acquire();
+    }
+
+    // Sorted copy of every published pointer, for is_protected().
+    // A reader publishing after this started may only reach nodes that
+    // were still linked when it validated, which are not retired yet.
+    void snapshot(std::vector<T*>* published) {
+        published->clear();
+        _records.for_each([published](HazardRecord<T>* record) {
+            for (auto& slot : record->slots) {
+                T* ptr = slot.hazardous_pointer.load();
+                if (ptr != nullptr) {
+                    published->push_back(ptr);
+                }
+            }
+        });
+        _overflow.collect(published);
+        std::sort(published->begin(), published->end());
+    }
+
+    // thread slots plus the shared ones taken when a thread ran out
+    size_t slots() const {
+        size_t n = 0;
+        _records.for_each([&n](HazardRecord<T>*) {
+            n += HazardRecord<T>::SLOTS;
+        });
+        return n + _overflow.size();
+    }
+
+    static bool is_protected(const std::vector<T*>& published, const T* ptr) {
+        // all() is the smallest pointer value that can be published
+        return (!published.empty() && published.front() == HazardPointer<T>::all())
+            || std::binary_search(published.begin(), published.end(), ptr);
+    }
+private:
+    tls::Registry<HazardRecord<T>> _records;
+    HazardPointerList<T> _overflow;
+};
 }
 #endif
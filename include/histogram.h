@@ -0,0 +1,106 @@
+#ifndef KV_SERVER_HISTOGRAM_H
+#define KV_SERVER_HISTOGRAM_H
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace kvservice {
+
+// Log-linear latency histogram in the spirit of HdrHistogram: values are
+// kept with SUB_BITS bits of precision (under 1% relative error) from 0
+// to 2^63. Recording is a few arithmetic ops and one increment. Not
+// thread safe, keep one per thread and merge them afterwards.
+class Histogram {
+public:
+    Histogram() : _counts(BUCKETS, 0) { }
+
+    void record(uint64_t value) {
+        ++_counts[index_of(value)];
+        ++_count;
+        _sum += value;
+        _min = std::min(_min, value);
+        _max = std::max(_max, value);
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < _counts.size(); ++i) {
+            _counts[i] += other._counts[i];
+        }
+        _count += other._count;
+        _sum += other._sum;
+        _min = std::min(_min, other._min);
+        _max = std::max(_max, other._max);
+    }
+
+    void clear() {
+        std::fill(_counts.begin(), _counts.end(), 0);
+        _count = 0;
+        _sum = 0;
+        _min = UINT64_MAX;
+        _max = 0;
+    }
+
+    // smallest recorded value v such that p percent of values are <= v,
+    // up to the bucket precision
+    uint64_t percentile(double p) const {
+        if (_count == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p / 100.0 * _count + 0.5);
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < _counts.size(); ++i) {
+            seen += _counts[i];
+            if (seen >= rank) {
+                return std::min(upper_bound_of(i), _max);
+            }
+        }
+        return _max;
+    }
+
+    uint64_t count() const {
+        return _count;
+    }
+    uint64_t min() const {
+        return _count == 0 ? 0 : _min;
+    }
+    uint64_t max() const {
+        return _max;
+    }
+    double mean() const {
+        return _count == 0 ? 0 : static_cast<double>(_sum) / _count;
+    }
+private:
+    static const int SUB_BITS = 7;
+    static const uint64_t SUB_COUNT = 1ULL << SUB_BITS;
+    // values below SUB_COUNT map to themselves, each later power of two
+    // gets SUB_COUNT / 2 buckets
+    static const size_t BUCKETS = SUB_COUNT + (64 - SUB_BITS) * SUB_COUNT / 2;
+
+    static size_t index_of(uint64_t value) {
+        if (value < SUB_COUNT) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+        // value >> shift is in [SUB_COUNT / 2, SUB_COUNT)
+        return SUB_COUNT + (shift - 1) * (SUB_COUNT / 2)
+            + ((value >> shift) - SUB_COUNT / 2);
+    }
+
+    static uint64_t upper_bound_of(size_t index) {
+        if (index < SUB_COUNT) {
+            return index;
+        }
+        size_t shift = (index - SUB_COUNT) / (SUB_COUNT / 2) + 1;
+        uint64_t sub = (index - SUB_COUNT) % (SUB_COUNT / 2) + SUB_COUNT / 2;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> _counts;
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+    uint64_t _min = UINT64_MAX;
+    uint64_t _max = 0;
+};
+}
+#endif
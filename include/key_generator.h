@@ -0,0 +1,98 @@
+#ifndef KV_SERVER_KEY_GENERATOR_H
+#define KV_SERVER_KEY_GENERATOR_H
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include "bloom_filter.h"
+
+namespace kvservice {
+
+// Keys in [0, n) drawn from a distribution, for the benchmark tools.
+// Build one, then fork() a copy per thread; a generator is not thread
+// safe.
+class KeyGenerator {
+public:
+    enum Distribution {
+        UNIFORM,
+        // YCSB style scrambled zipfian: rank r is drawn with weight
+        // 1 / (r + 1)^theta and hashed, so hot keys spread over shards
+        ZIPFIAN,
+        // every thread walks its own slice of the key space in order
+        SEQUENTIAL,
+    };
+
+    static int parse_distribution(const std::string& name, Distribution* dist) {
+        if (name == "uniform") {
+            *dist = UNIFORM;
+        } else if (name == "zipfian") {
+            *dist = ZIPFIAN;
+        } else if (name == "sequential") {
+            *dist = SEQUENTIAL;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+
+    // theta is the zipfian skew in (0, 1), zeta(n) is summed here once
+    KeyGenerator(Distribution dist, uint64_t n, double theta)
+        : _dist(dist), _n(n > 0 ? n : 1), _theta(theta) {
+        if (_dist == ZIPFIAN) {
+            double zeta2 = 1 + std::pow(0.5, _theta);
+            _zetan = 0;
+            for (uint64_t i = 1; i <= _n; ++i) {
+                _zetan += 1 / std::pow(static_cast<double>(i), _theta);
+            }
+            _alpha = 1 / (1 - _theta);
+            _eta = (1 - std::pow(2.0 / _n, 1 - _theta)) / (1 - zeta2 / _zetan);
+        }
+    }
+
+    // generator of thread index out of total
+    KeyGenerator fork(int index, int total) const {
+        KeyGenerator g(*this);
+        g._rng.seed(0x9e3779b97f4a7c15ULL * (index + 1));
+        g._next = _n * index / (total > 0 ? total : 1);
+        return g;
+    }
+
+    uint64_t next() {
+        switch (_dist) {
+        case UNIFORM:
+            return _rng() % _n;
+        case SEQUENTIAL: {
+            uint64_t key = _next;
+            _next = (_next + 1 == _n) ? 0 : _next + 1;
+            return key;
+        }
+        default:
+            return skiplist::mix_hash(zipf_rank()) % _n;
+        }
+    }
+private:
+    // Gray et al, "Quickly generating billion-record synthetic databases"
+    uint64_t zipf_rank() {
+        double u = std::uniform_real_distribution<double>(0, 1)(_rng);
+        double uz = u * _zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, _theta)) {
+            return 1;
+        }
+        uint64_t rank = static_cast<uint64_t>(_n * std::pow(_eta * u - _eta + 1, _alpha));
+        return rank < _n ? rank : _n - 1;
+    }
+
+    Distribution _dist;
+    uint64_t _n;
+    double _theta;
+    double _zetan = 0;
+    double _alpha = 0;
+    double _eta = 0;
+    std::mt19937_64 _rng;
+    uint64_t _next = 0;
+};
+}
+#endif
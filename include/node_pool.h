@@ -0,0 +1,112 @@
+#ifndef KV_SERVER_NODE_POOL_H
+#define KV_SERVER_NODE_POOL_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace skiplist {
+// Size classed allocator for skiplist nodes. Blocks are carved from large
+// slabs with a bump pointer, a freed block goes to the free list of its
+// class and is handed out again before the slab grows. Memory goes back to
+// the system only when the pool is destroyed. Not thread safe, only the
+// writer of a list allocates and frees, except deallocate_remote.
+class NodePool {
+public:
+    // class i holds blocks of base_size + i * step bytes
+    NodePool(size_t base_size, size_t step, int classes)
+        : _base_size(base_size), _step(step), _free(classes, nullptr)
+        , _remote(new std::atomic<FreeBlock*>[classes]) {
+        for (int i = 0; i < classes; ++i) {
+            _remote[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~NodePool() {
+        for (char* slab : _slabs) {
+            ::operator delete(slab);
+        }
+    }
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    void* allocate(int cls) {
+        size_t size = block_size(cls);
+        _used_bytes += size;
+        FreeBlock* block = _free[cls];
+        if (block == nullptr) {
+            // take all the blocks freed by other threads at once
+            block = _remote[cls].exchange(nullptr, std::memory_order_acquire);
+        }
+        if (block != nullptr) {
+            _free[cls] = block->next;
+            return block;
+        }
+        if (_left < size) {
+            // the tail of the old slab is dropped, it is smaller than a block
+            _cur = static_cast<char*>(::operator new(SLAB_SIZE));
+            _left = SLAB_SIZE;
+            _slabs.push_back(_cur);
+        }
+        void* p = _cur;
+        _cur += size;
+        _left -= size;
+        return p;
+    }
+
+    void deallocate(void* p, int cls) {
+        _used_bytes -= block_size(cls);
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        block->next = _free[cls];
+        _free[cls] = block;
+    }
+
+    // free from another thread, e.g. a reclaimer, the block is reused once
+    // the owner runs out of local free blocks of the class
+    void deallocate_remote(void* p, int cls) {
+        _remote_bytes.fetch_add(block_size(cls), std::memory_order_relaxed);
+        FreeBlock* block = static_cast<FreeBlock*>(p);
+        FreeBlock* head = _remote[cls].load(std::memory_order_relaxed);
+        do {
+            block->next = head;
+        } while (!_remote[cls].compare_exchange_weak(head, block,
+                    std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // bytes of blocks handed out and not freed
+    size_t used_bytes() const {
+        return _used_bytes - _remote_bytes.load(std::memory_order_relaxed);
+    }
+    // bytes taken from the system
+    size_t reserved_bytes() const {
+        return _slabs.size() * SLAB_SIZE;
+    }
+
+    // bytes a block of class cls takes, alignment included
+    size_t block_size(int cls) const {
+        size_t size = _base_size + cls * _step;
+        return (size + ALIGN - 1) & ~(ALIGN - 1);
+    }
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static const size_t ALIGN = alignof(std::max_align_t);
+    static const size_t SLAB_SIZE = 1 << 20;
+    const size_t _base_size;
+    const size_t _step;
+    std::vector<FreeBlock*> _free;
+    // per class stacks freed by other threads
+    std::unique_ptr<std::atomic<FreeBlock*>[]> _remote;
+    std::atomic<size_t> _remote_bytes{0};
+    std::vector<char*> _slabs;
+    char* _cur = nullptr;
+    size_t _left = 0;
+    size_t _used_bytes = 0;
+};
+}
+#endif
@@ -0,0 +1,351 @@
+#ifndef KV_SERVER_RECLAIMER_H
+#define KV_SERVER_RECLAIMER_H
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "epoch.h"
+#include "hazard.h"
+
+namespace reclaim {
+
+enum Policy {
+    // readers publish each node they use, the writer checks every retired
+    // node against all of them
+    HAZARD_POINTER,
+    // readers announce an epoch per section, see ebr::EpochDomain
+    EPOCH,
+};
+
+inline int parse_policy(const std::string& name, Policy* policy) {
+    if (name == "hazard") {
+        *policy = HAZARD_POINTER;
+    } else if (name == "epoch") {
+        *policy = EPOCH;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+template <typename T>
+class Guard;
+
+// Deferred free of objects unlinked by a single writer while lock free
+// readers may still hold them, e.g. nodes and replaced values. Each one
+// is retired with a kind that is passed back to the free function. The
+// policy is fixed at construction.
+// Retired nodes are freed in batches by collect() on the writer, or, once
+// start_thread() was called, on a reclaimer thread of their own: the
+// writer then only hands the batch over. Under epochs, several writers
+// may retire with retire_shared() once enable_shared_retire() was called.
+template <typename T>
+class Reclaimer {
+public:
+    typedef std::function<void(T*, int kind)> FreeFn;
+
+    Reclaimer(Policy policy, FreeFn free_node)
+        : _policy(policy), _free_node(std::move(free_node)) { }
+    ~Reclaimer() {
+        stop_thread();
+    }
+
+    Reclaimer(const Reclaimer&) = delete;
+    Reclaimer& operator=(const Reclaimer&) = delete;
+
+    Policy policy() const {
+        return _policy;
+    }
+
+    // free_node runs on the reclaimer thread from now on
+    void start_thread() {
+        if (_thread.joinable()) {
+            return;
+        }
+        _stop = false;
+        _thread = std::thread([this](){ this->thread_loop(); });
+    }
+
+    // nodes the thread did not free yet go back to the writer side
+    void stop_thread() {
+        if (!_thread.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            _stop = true;
+        }
+        _cond.notify_one();
+        _thread.join();
+        _retired.insert(_retired.begin(), _handoff.begin(), _handoff.end());
+        _handoff.clear();
+    }
+
+    bool background() const {
+        return _thread.joinable();
+    }
+
+    // Let any thread retire with retire_shared, epoch policy only. The
+    // reclaimer thread polls for them, it has to be started too.
+    void enable_shared_retire() {
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            _shared_retire = true;
+        }
+        _cond.notify_one();
+    }
+
+    // retire from any thread, taken by the reclaimer thread's next pass
+    void retire_shared(T* node, int kind = 0) {
+        // the unlink must be visible before the stamp is read
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        SharedRetired* entry = new SharedRetired{{_epochs.current(), node, kind}, nullptr};
+        SharedRetired* head = _shared.load(std::memory_order_relaxed);
+        do {
+            entry->next = head;
+        } while (!_shared.compare_exchange_weak(head, entry,
+                    std::memory_order_release, std::memory_order_relaxed));
+        _retired_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // node is unlinked, free it once no reader can reach it
+    void retire(T* node, int kind = 0) {
+        _retired.push_back({_policy == EPOCH ? _epochs.current() : 0, node, kind});
+        _retired_count.store(_retired_count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    }
+
+    // nodes retired since the last collect
+    size_t retired() const {
+        return _retired.size();
+    }
+
+    // Free every retired node readers are done with, or hand them all to
+    // the reclaimer thread.
+    void collect() {
+        if (!background()) {
+            collect(_retired);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lk(_mutex);
+            _handoff.insert(_handoff.end(), _retired.begin(), _retired.end());
+        }
+        _retired.clear();
+        _cond.notify_one();
+    }
+
+    // free everything, only when no reader is left
+    void free_all() {
+        stop_thread();
+        take_shared(_retired);
+        for (auto& entry : _retired) {
+            free_node(entry);
+        }
+        _retired.clear();
+    }
+
+    // retired nodes not freed yet
+    size_t backlog() const {
+        return _retired_count.load(std::memory_order_relaxed)
+            - _freed_count.load(std::memory_order_relaxed);
+    }
+    // nodes the last pass had to keep because a reader might hold them
+    size_t pinned() const {
+        return _pinned.load(std::memory_order_relaxed);
+    }
+    // reader records of the policy: epoch records, or hazard slots
+    size_t reader_slots() const {
+        return _policy == EPOCH ? _epochs.records() : _hazards.slots();
+    }
+private:
+    friend class Guard<T>;
+
+    struct Retired {
+        // epoch at retire
+        uint64_t stamp;
+        T* ptr;
+        int kind;
+    };
+    typedef std::deque<Retired> RetiredList;
+
+    // retire_shared stack entry
+    struct SharedRetired {
+        Retired entry;
+        SharedRetired* next;
+    };
+
+    static const int RETRY_INTERVAL_MS = 10;
+
+    void free_node(const Retired& entry) {
+        _free_node(entry.ptr, entry.kind);
+        _freed_count.store(_freed_count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    }
+
+    // one pass over nodes, the ones still in use stay in it
+    void collect(RetiredList& nodes) {
+        if (_policy == EPOCH) {
+            // stamps only grow, the safe nodes are a prefix
+            uint64_t oldest = _epochs.advance();
+            while (!nodes.empty() && nodes.front().stamp < oldest) {
+                free_node(nodes.front());
+                nodes.pop_front();
+            }
+        } else {
+            _hazards.snapshot(&_published);
+            auto keep = std::remove_if(nodes.begin(), nodes.end(),
+                    [&](const Retired& entry) {
+                        if (hp::HazardDomain<T>::is_protected(_published, entry.ptr)) {
+                            return false;
+                        }
+                        free_node(entry);
+                        return true;
+                    });
+            nodes.erase(keep, nodes.end());
+        }
+        _pinned.store(nodes.size(), std::memory_order_relaxed);
+    }
+
+    // move the shared stack into nodes, keeping it sorted by stamp: a
+    // writer may be preempted between its stamp and its push
+    void take_shared(RetiredList& nodes) {
+        SharedRetired* head = _shared.exchange(nullptr, std::memory_order_acquire);
+        if (head == nullptr) {
+            return;
+        }
+        size_t old_size = nodes.size();
+        while (head != nullptr) {
+            SharedRetired* next = head->next;
+            nodes.push_back(head->entry);
+            delete head;
+            head = next;
+        }
+        auto by_stamp = [](const Retired& a, const Retired& b) {
+            return a.stamp < b.stamp;
+        };
+        auto middle = nodes.begin() + old_size;
+        std::sort(middle, nodes.end(), by_stamp);
+        std::inplace_merge(nodes.begin(), middle, nodes.end(), by_stamp);
+    }
+
+    void thread_loop() {
+        RetiredList pending;
+        while (true) {
+            bool stop = false;
+            {
+                std::unique_lock<std::mutex> lk(_mutex);
+                auto ready = [&]{return !_handoff.empty() || _stop;};
+                if (pending.empty() && !_shared_retire) {
+                    _cond.wait(lk, ready);
+                } else {
+                    // nodes still pinned are tried again after a while
+                    _cond.wait_for(lk, std::chrono::milliseconds(
+                            static_cast<int64_t>(RETRY_INTERVAL_MS)), ready);
+                }
+                pending.insert(pending.end(), _handoff.begin(), _handoff.end());
+                _handoff.clear();
+                stop = _stop;
+            }
+            take_shared(pending);
+            if (!pending.empty()) {
+                collect(pending);
+            }
+            if (stop) {
+                break;
+            }
+        }
+        // retire order is kept for the stamps, older nodes go first
+        std::lock_guard<std::mutex> lk(_mutex);
+        _handoff.insert(_handoff.begin(), pending.begin(), pending.end());
+    }
+
+    const Policy _policy;
+    FreeFn _free_node;
+    hp::HazardDomain<T> _hazards;
+    ebr::EpochDomain _epochs;
+    // pointers published by readers, reused by every hazard pass
+    std::vector<T*> _published;
+    // in retire order, writer side
+    RetiredList _retired;
+
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _stop = false;
+    // handed over by the writer, not taken by the thread yet
+    RetiredList _handoff;
+    // the thread polls _shared instead of waiting for a handoff
+    bool _shared_retire = false;
+    // retire_shared entries, newest first
+    std::atomic<SharedRetired*> _shared{nullptr};
+
+    // one writer each, read by metrics; retire_shared adds to the first
+    // with fetch_add, retire is not called then
+    std::atomic<uint64_t> _retired_count{0};
+    std::atomic<uint64_t> _freed_count{0};
+    std::atomic<size_t> _pinned{0};
+};
+
+// A reader section. Under hazard pointers a node is safe only once
+// protect()ed and found still linked afterwards; under epochs every node
+// reached inside the section is safe and protect() does nothing. Slots
+// and epochs are per thread, a guard must be released on the thread that
+// took it and the thread must not block in between.
+template <typename T>
+class Guard {
+public:
+    static const int SLOTS = 3;
+
+    explicit Guard(Reclaimer<T>* reclaimer) : _reclaimer(reclaimer) {
+        if (reclaimer->_policy == EPOCH) {
+            _record = reclaimer->_epochs.enter();
+        }
+    }
+    ~Guard() {
+        if (_record != nullptr) {
+            _reclaimer->_epochs.exit(_record);
+        }
+        for (auto hazard : _hazards) {
+            if (hazard != nullptr) {
+                hazard->release();
+            }
+        }
+    }
+
+    Guard(const Guard&) = delete;
+    Guard& operator=(const Guard&) = delete;
+
+    void protect(T* node, int slot = 0) {
+        if (_record == nullptr) {
+            hazard(slot)->remember(node);
+        }
+    }
+
+    // keep every node until the guard goes away
+    void protect_all() {
+        if (_record == nullptr) {
+            hazard(0)->remember_all();
+        }
+    }
+private:
+    hp::HazardPointer<T>* hazard(int slot) {
+        if (_hazards[slot] == nullptr) {
+            _hazards[slot] = _reclaimer->_hazards.acquire();
+        }
+        return _hazards[slot];
+    }
+
+    Reclaimer<T>* _reclaimer;
+    ebr::EpochRecord* _record = nullptr;
+    hp::HazardPointer<T>* _hazards[SLOTS] = {};
+};
+}
+#endif
@@ -1,36 +1,20 @@
 #ifndef KV_SERVER_SERVER_H
 #define KV_SERVER_SERVER_H
-#include <boost/lockfree/queue.hpp>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 #include "baidu/rpc/server.h"
 #include "baidu/personal-code/fengjialin-kv-server/proto/kvservice.pb.h"
-#include "skiplist.h"
+#include "shard.h"
 
 namespace kvservice {
 
-template <typename L>
-class ClosureWithLamba : public ::google::protobuf::Closure {
-public:
-    ClosureWithLamba(L&& l) : _l(l) {}
-    void Run() override {
-        _l();
-        delete this;
-    }
-private:
-    L _l;
-};
-
-template <typename L>
-::google::protobuf::Closure* create_closure(L&& l) {
-    return new ClosureWithLamba<L>(std::move(l));
-}
-
 class KVServiceImpl : public KVService
 {
 public:
-    KVServiceImpl() : _queue(512) { };
+    KVServiceImpl() { };
     virtual ~KVServiceImpl() {stop();};
     void get(::google::protobuf::RpcController* cntl_base,
             const GetRequest* request,
@@ -44,20 +28,39 @@ public:
             const RemoveRequest* request,
             CommonResponse* response,
             ::google::protobuf::Closure* done);
+    void multi_get(::google::protobuf::RpcController* cntl_base,
+            const MultiGetRequest* request,
+            MultiGetResponse* response,
+            ::google::protobuf::Closure* done);
+    void multi_put(::google::protobuf::RpcController* cntl_base,
+            const MultiPutRequest* request,
+            CommonResponse* response,
+            ::google::protobuf::Closure* done);
+    void scan(::google::protobuf::RpcController* cntl_base,
+            const ScanRequest* request,
+            ScanResponse* response,
+            ::google::protobuf::Closure* done);
+    void snapshot(::google::protobuf::RpcController* cntl_base,
+            const SnapshotRequest* request,
+            CommonResponse* response,
+            ::google::protobuf::Closure* done);
     int stop();
     int start();
 private:
-    void write_loop();
-    skiplist::SkipList<int, std::string>* _skip_list = nullptr;
-    // one thread for write
-    std::thread _write_thread;
-    // use queue
-    boost::lockfree::queue<::google::protobuf::Closure*> _queue;
-    std::mutex _mutex;
-    std::condition_variable _cond;
-    // run status
-    bool _stop;
-    int _write_cnt;
+    // pick the shard owning key, by FLAGS_shard_policy
+    KVShard* route(const skiplist::ByteKey& key);
+    // snapshot every shard each FLAGS_snapshot_interval_s
+    void snapshot_loop();
+
+    // keyspace is split into shards, each one with its own writer thread
+    std::vector<std::unique_ptr<KVShard>> _shards;
+    bool _range_policy = false;
+    // keys come from the string_key fields, see FLAGS_key_type
+    bool _string_keys = false;
+    std::thread _snapshot_timer;
+    std::mutex _timer_mutex;
+    std::condition_variable _timer_cond;
+    bool _timer_stop = false;
 };
 }
 #endif
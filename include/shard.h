@@ -0,0 +1,267 @@
+#ifndef KV_SERVER_SHARD_H
+#define KV_SERVER_SHARD_H
+#include <atomic>
+#include <base/iobuf.h>
+#include <bvar/bvar.h>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <google/protobuf/service.h>
+#include "byte_key.h"
+#include "skiplist.h"
+#include "value_log.h"
+#include "wal.h"
+#include "write_ring.h"
+
+namespace kvservice {
+
+// int64 and byte string keys are both ByteKeys, see --key_type. Values
+// share their blocks with rpc attachments, copying one is cheap.
+typedef skiplist::SkipList<skiplist::ByteKey, base::IOBuf> KVSkipList;
+
+template <typename L>
+class ClosureWithLamba : public ::google::protobuf::Closure {
+public:
+    ClosureWithLamba(L&& l) : _l(l) {}
+    void Run() override {
+        _l();
+        delete this;
+    }
+private:
+    L _l;
+};
+
+template <typename L>
+::google::protobuf::Closure* create_closure(L&& l) {
+    return new ClosureWithLamba<L>(std::move(l));
+}
+
+// one mutation waiting for the writer thread
+struct WriteTask {
+    enum Type {
+        PUT,
+        REMOVE,
+        // freeze the skiplist for an online snapshot
+        SNAPSHOT,
+        // put every entry of the task
+        MULTI_PUT,
+        // switch keys over to the values compaction copied, not logged
+        RELOCATE,
+    };
+
+    explicit WriteTask(Type t, skiplist::ByteKey k = skiplist::ByteKey())
+        : type(t), key(std::move(k)), sequence(0)
+        , result(false), io_error(false), rejected(false), done(nullptr) { }
+
+    Type type;
+    skiplist::ByteKey key;
+    // PUT only, shares its blocks with the request when taken from an
+    // attachment
+    base::IOBuf value;
+    // PUT only, wall clock ms the key expires at, 0 for never
+    uint64_t expire_ms = 0;
+    // MULTI_PUT only, sorted by key
+    std::vector<std::pair<skiplist::ByteKey, base::IOBuf>> entries;
+    // RELOCATE only
+    std::vector<ValueMove> moves;
+    // filled by the writer thread before done is run:
+    // wal sequence of the write, or the last one a snapshot holds
+    uint64_t sequence;
+    bool result;
+    // the write could not be made durable in the wal or the value log
+    bool io_error;
+    // the write queue was full, nothing was applied and the caller may
+    // retry
+    bool rejected;
+    // set by submit, for the queue wait metric
+    std::chrono::steady_clock::time_point submit_time;
+    // responds to the caller, run once the whole batch is applied
+    ::google::protobuf::Closure* done;
+};
+
+// KVShard owns one slice of the keyspace: a skiplist, the queue of pending
+// writes and the single thread allowed to mutate the skiplist. With
+// --write_mode=direct there is no queue nor writer thread, the skiplist
+// takes writes from any thread.
+class KVShard {
+public:
+    // wal_file empty means no write ahead log, value_log_file empty keeps
+    // every value in the skiplist
+    KVShard(int id, const std::string& dump_file, const std::string& wal_file,
+            const std::string& value_log_file)
+        : _id(id), _dump_file(dump_file), _wal_file(wal_file), _value_log_file(value_log_file)
+        , _queue_depth(get_queue_depth, this)
+        , _gc_backlog(get_gc_backlog, this), _gc_pinned(get_gc_pinned, this)
+        , _gc_reader_slots(get_gc_reader_slots, this)
+        , _list_size(get_list_size, this), _list_level(get_list_level, this)
+        , _key_bytes(get_key_bytes, this), _value_bytes(get_value_bytes, this)
+        , _ttl_keys(get_ttl_keys, this)
+        , _memory_bytes(get_memory_bytes, this), _evicted(get_evicted, this)
+        , _value_log_bytes(get_value_log_bytes, this)
+        , _value_log_live_bytes(get_value_log_live_bytes, this) { }
+    ~KVShard() {stop();}
+
+    int start();
+    int stop();
+    // hand a write to the writer thread, task->done is run exactly once.
+    // In direct mode the write is applied and done run before it returns.
+    // Returns false if the write queue stayed full for
+    // --write_queue_full_wait_us: task->rejected is set and done has run.
+    bool submit(WriteTask* task);
+    // Take a point-in-time snapshot into the dump file in background.
+    // Returns -1 if one is still running, there is no dump file or the
+    // shard is in direct mode.
+    int snapshot();
+    // Any thread. Look key up and read its value from the value log if it
+    // is there: 1 if found, 0 if not, -1 if the value log failed.
+    int get(const skiplist::ByteKey& key, base::IOBuf* value);
+    // the same for a value read from skip_list() under key, value holds
+    // what the skiplist stores and gets the value itself
+    int resolve(const skiplist::ByteKey& key, base::IOBuf* value);
+
+    KVSkipList* skip_list() {
+        return _skip_list;
+    }
+    int id() const {
+        return _id;
+    }
+private:
+    void write_loop();
+    // poll the queue for --writer_spin_us, true once a write is there
+    bool spin();
+    // sleep until a write is queued, stop() or deadline if timed. Returns
+    // false on timeout.
+    bool park(bool timed, std::chrono::steady_clock::time_point deadline);
+    // wake the writer if it sleeps, after a push
+    void wake();
+    // pop up to max tasks into batch, return number popped
+    size_t drain(std::vector<WriteTask*>& batch, size_t max);
+    // log the batch to wal, and apply it to the skiplist unless it waits
+    // for an fsync
+    void commit(std::vector<WriteTask*>& batch);
+    void apply(WriteTask* task);
+    // apply the tasks without an io error
+    void apply_all(std::vector<WriteTask*>& tasks);
+    // writer side of a put, large values go to the value log first
+    bool insert(const skiplist::ByteKey& key, const base::IOBuf& value, uint64_t expire_ms,
+            bool* io_error);
+    // switch a key over to the copy of its value if it still refers to
+    // the original
+    void relocate(const ValueMove& move);
+    // compaction thread: have the writer apply moves, false if it did not
+    bool submit_moves(std::vector<ValueMove>* moves);
+    void compact_loop();
+    // fsync wal, then apply and respond to the writes waiting for it
+    void sync_pending();
+    // unlink a bounded number of expired keys once the check is due
+    void expire();
+    void respond(std::vector<WriteTask*>& tasks);
+    // writer side of a snapshot, dumping is left to _snapshot_thread
+    bool start_snapshot(uint64_t sequence);
+    // dump is the value log dump number taken with the image
+    void run_snapshot(uint64_t sequence, uint64_t dump);
+    // expose or hide every metric
+    void expose_metrics();
+    void hide_metrics();
+    static int64_t get_queue_depth(void* shard);
+    static int64_t get_gc_backlog(void* shard);
+    static int64_t get_gc_pinned(void* shard);
+    static int64_t get_gc_reader_slots(void* shard);
+    static int64_t get_list_size(void* shard);
+    static int64_t get_list_level(void* shard);
+    static int64_t get_key_bytes(void* shard);
+    static int64_t get_value_bytes(void* shard);
+    static int64_t get_ttl_keys(void* shard);
+    static int64_t get_memory_bytes(void* shard);
+    static int64_t get_evicted(void* shard);
+    static int64_t get_value_log_bytes(void* shard);
+    static int64_t get_value_log_live_bytes(void* shard);
+
+    int _id;
+    std::string _dump_file;
+    std::string _wal_file;
+    std::string _value_log_file;
+    std::unique_ptr<Wal> _wal;
+    std::unique_ptr<ValueLog> _value_log;
+    // compacts the value log every --value_log_gc_interval_s
+    std::thread _compact_thread;
+    std::mutex _compact_mutex;
+    std::condition_variable _compact_cond;
+    // set under _compact_mutex
+    std::atomic<bool> _compact_stop{false};
+    Wal::SyncPolicy _sync_policy = Wal::SYNC_ALWAYS;
+    // sequence of the last write logged
+    uint64_t _sequence = 0;
+    // writes logged but waiting for the next fsync to be applied
+    std::vector<WriteTask*> _pending_sync;
+    // a wal fsync failed, every write is refused from then on
+    bool _wal_broken = false;
+    std::chrono::steady_clock::time_point _next_sync;
+    // next time the writer looks for expired keys
+    std::chrono::steady_clock::time_point _next_expire;
+    // wal moves to a new segment after the batch, so that the segments
+    // before a snapshot can be dropped once it is written
+    bool _rotate_wal = false;
+    std::thread _snapshot_thread;
+    std::atomic<bool> _snapshot_running{false};
+    KVSkipList* _skip_list = nullptr;
+    // values get blocks of their own size, so that the memory limit
+    // counts what they hold
+    bool _own_values = false;
+    // start succeeded, stop only dumps a list that was fully recovered
+    bool _started = false;
+    // writes applied by the submitting thread, see --write_mode
+    bool _direct = false;
+    // one thread for write
+    std::thread _write_thread;
+    // bounded, see --write_queue_size
+    std::unique_ptr<WriteRing<WriteTask*>> _queue;
+    // _parked is set under _mutex by the writer before it waits on _cond,
+    // producers only take the mutex to notify when they see it
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::atomic<bool> _parked{false};
+    // run status, set under _mutex
+    std::atomic<bool> _stop{true};
+    // tasks applied per writer wakeup
+    bvar::IntRecorder _batch_size;
+    bvar::Maxer<int64_t> _max_batch_size;
+    bvar::Adder<int64_t> _batch_count;
+    bvar::LatencyRecorder _wal_sync_latency;
+    bvar::LatencyRecorder _snapshot_latency;
+    // writes queued, time from submit until the writer takes a write,
+    // and time per batch to log it and to apply it to the skiplist
+    bvar::PassiveStatus<int64_t> _queue_depth;
+    bvar::LatencyRecorder _queue_wait_latency;
+    bvar::LatencyRecorder _wal_write_latency;
+    bvar::LatencyRecorder _apply_latency;
+    // writes rejected because the queue was full
+    bvar::Adder<int64_t> _rejected_count;
+    // removed nodes not freed yet, and those readers still held at the
+    // last gc pass
+    bvar::PassiveStatus<int64_t> _gc_backlog;
+    bvar::PassiveStatus<int64_t> _gc_pinned;
+    bvar::PassiveStatus<int64_t> _gc_reader_slots;
+    bvar::PassiveStatus<int64_t> _list_size;
+    bvar::PassiveStatus<int64_t> _list_level;
+    bvar::PassiveStatus<int64_t> _key_bytes;
+    bvar::PassiveStatus<int64_t> _value_bytes;
+    // keys waiting to expire, and keys unlinked because they expired
+    bvar::PassiveStatus<int64_t> _ttl_keys;
+    bvar::Adder<int64_t> _expired_count;
+    // bytes held by the skiplist against --memory_limit_mb, and keys
+    // evicted to stay under it
+    bvar::PassiveStatus<int64_t> _memory_bytes;
+    bvar::PassiveStatus<int64_t> _evicted;
+    // bytes of the value log, of the values still referred to, and
+    // segments compacted away
+    bvar::PassiveStatus<int64_t> _value_log_bytes;
+    bvar::PassiveStatus<int64_t> _value_log_live_bytes;
+    bvar::Adder<int64_t> _value_log_compacted;
+};
+}
+#endif
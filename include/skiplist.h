@@ -1,35 +1,113 @@
 #ifndef KV_SERVER_SKIP_LIST_H
 #define KV_SERVER_SKIP_LIST_H
 #include <boost/lockfree/queue.hpp>
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <fstream>
+#include <functional>
 #include <base/logging.h>
 #include <list>
-#include "hazard.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "bloom_filter.h"
+#include "hash_index.h"
+#include "node_pool.h"
+#include "reclaimer.h"
+#include "snapshot.h"
+#include "timer_wheel.h"
 
 namespace skiplist {
 //forward declaration
 template<typename K, typename V>
 class SkipList;
 
+// bytes of a key or value held by the list, for the metrics
+template<typename T>
+size_t payload_size(const T&) {
+    return sizeof(T);
+}
+inline size_t payload_size(const std::string& v) {
+    return v.size();
+}
+inline size_t payload_size(const base::IOBuf& v) {
+    return v.size();
+}
+
+// An order preserving 64 bit summary of a key, a < b implies
+// key_prefix(a) <= key_prefix(b). Types without one map to 0 and never
+// take the prefix shortcut of a search.
+template<typename T>
+uint64_t key_prefix(const T&) {
+    return 0;
+}
+inline uint64_t key_prefix(int64_t k) {
+    return static_cast<uint64_t>(k) ^ (1ULL << 63);
+}
+
+// An immutable value. A node points to its current block, an update of
+// the key publishes a new one and leaves the node where it is.
+template<typename V>
+struct ValueBlock {
+    ValueBlock(const V& v, uint64_t ver, uint64_t expire = 0)
+        : value(v), version(ver), expire_ms(expire) { }
+
+    // the clock is only read for values with an expire time
+    bool expired() const {
+        return expire_ms != 0 && expire_ms <= wall_time_ms();
+    }
+
+    const V value;
+    // list version when the value was written, see SkipList::begin_snapshot
+    const uint64_t version;
+    // wall clock ms the key expires at, 0 for never
+    const uint64_t expire_ms;
+};
+
+// A node is one variable size block from the list's NodePool: the fixed
+// fields are followed by level forward pointers, then for levels above 0
+// the key_prefix of the node each one points to. key sits right before
+// them so a search hop touches one place, and there is no vtable. With the
+// prefixes a search goes down a level without loading the next node, a
+// node of level 1 has none and keeps its size.
 template<typename K, typename V>
 struct Node {
     friend class SkipList<K, V>;
     
-    Node() {}
+    explicit Node(int l) : value(nullptr), level(l), key() {
+        init_forward();
+    }
 
-    Node(const K& k, const V& v) : key(k), value(v) {
-        level = 0;
+    Node(int l, const K& k, ValueBlock<V>* v) : value(v), level(l), key(k) {
+        init_forward();
     }
-   
-    virtual ~Node() {
-        delete []forward;
+
+    // the current value goes with the node, replaced ones are retired
+    ~Node() {
+        delete value.load(std::memory_order_relaxed);
     }
 
-    K key;
-    V value;
+    // null for the header and the footer
+    std::atomic<ValueBlock<V>*> value;
+    // set by the writer once the node is out of the list, see Iterator
+    std::atomic<bool> unlinked{false};
+    // CLOCK reference bit, set by search and cleared by the writer's
+    // eviction hand
+    std::atomic<bool> referenced{false};
+    // false while a concurrent insert still links the upper levels
+    std::atomic<bool> fully_linked{true};
     int level;
+    K key;
+
+    // bytes of a node with level forward pointers
+    static size_t size_of(int level) {
+        return sizeof(Node<K, V>) + (level - 1) * LEVEL_SIZE;
+    }
+    // bytes a level above the first adds
+    static const size_t LEVEL_SIZE = sizeof(std::atomic<Node<K, V>*>) + sizeof(std::atomic<uint64_t>);
 
     void set_next(int level, Node<K, V>* node) {
         assert(level >= 0);
@@ -41,23 +119,82 @@ struct Node {
         forward[level].store(node, std::memory_order_relaxed);
     }
 
+    // next and next_relaxed strip the remove mark, see marked()
     Node<K, V>* next(int level) {
         assert(level >= 0);
-        return reinterpret_cast<Node<K, V>*>(forward[level].load(std::memory_order_acquire));
+        return unmarked(forward[level].load(std::memory_order_acquire));
     }
 
     Node<K, V>* next_relaxed(int level) {
         assert(level >= 0);
-        return reinterpret_cast<Node<K, V>*>(forward[level].load(std::memory_order_relaxed));
+        return unmarked(forward[level].load(std::memory_order_relaxed));
+    }
+
+    // key_prefix of next(level), level > 0. Kept by the single writer
+    // only, readers may see it out of step with the pointer, which costs
+    // them a hop at most.
+    uint64_t next_prefix(int level) {
+        return prefix_at(level).load(std::memory_order_relaxed);
+    }
+
+    void set_next_prefix(int level, uint64_t prefix) {
+        prefix_at(level).store(prefix, std::memory_order_relaxed);
+    }
+
+    // the forward pointer with its mark
+    Node<K, V>* next_marked(int level) {
+        assert(level >= 0);
+        return forward[level].load(std::memory_order_acquire);
+    }
+
+    // expected gets the current pointer on failure
+    bool cas_next(int level, Node<K, V>*& expected, Node<K, V>* desired) {
+        assert(level >= 0);
+        return forward[level].compare_exchange_strong(expected, desired,
+                std::memory_order_acq_rel, std::memory_order_acquire);
+    }
+
+    // A concurrent remove sets bit 0 of the node's forward pointers, top
+    // level first, so that nothing is linked after it any more. The node is
+    // removed once level 0 is marked.
+    bool marked() {
+        return is_marked(forward[0].load(std::memory_order_acquire));
+    }
+    static bool is_marked(Node<K, V>* p) {
+        return (reinterpret_cast<uintptr_t>(p) & 1) != 0;
+    }
+    static Node<K, V>* with_mark(Node<K, V>* p) {
+        return reinterpret_cast<Node<K, V>*>(reinterpret_cast<uintptr_t>(p) | 1);
+    }
+    static Node<K, V>* unmarked(Node<K, V>* p) {
+        return reinterpret_cast<Node<K, V>*>(reinterpret_cast<uintptr_t>(p) & ~uintptr_t(1));
     }
 
     friend std::ostream & operator << (std::ostream &out, const Node<K, V> & obj) {
-        out << obj.key << obj.value << std::endl;
+        ValueBlock<V>* v = obj.value.load();
+        out << obj.key;
+        if (v != nullptr) {
+            out << v->value;
+        }
+        out << std::endl;
         return out;
     }
 
 private:
-    std::atomic<Node<K, V>*>* forward;
+    void init_forward() {
+        for (int i = 1; i < level; ++i) {
+            new (&forward[i]) std::atomic<Node<K, V>*>(nullptr);
+            new (&prefix_at(i)) std::atomic<uint64_t>(0);
+        }
+    }
+
+    std::atomic<uint64_t>& prefix_at(int l) {
+        assert(l > 0 && l < level);
+        return reinterpret_cast<std::atomic<uint64_t>*>(&forward[level])[l - 1];
+    }
+
+    // really level entries, the block is allocated with size_of(level)
+    std::atomic<Node<K, V>*> forward[1] = {};
 };
 
 
@@ -99,82 +236,466 @@ private:
 template<typename K, typename V>
 class SkipList{
 public:
-    SkipList(K footerKey) : _rnd(0x12345678) {
-        create_list(footerKey);
+    // Ordered reader over level 0, safe against concurrent writes. The
+    // current node and the one being stepped to are protected by the
+    // iterator's guard, so the writer cannot free them under it. Keys are
+    // returned in increasing order, each at most once.
+    class Iterator {
+    public:
+        explicit Iterator(SkipList<K, V>* list)
+            : _list(list)
+            , _cur(nullptr)
+            , _guard(&list->_reclaimer) { }
+
+        // position at the first key >= key, expired keys and keys a
+        // concurrent remove claimed are skipped
+        void seek(const K& key);
+        void next();
+        bool valid() const {
+            return _cur != nullptr && _cur != _list->_footer;
+        }
+        // only while valid(), the node stays pinned until the next move
+        const K& key() const {
+            return _cur->key;
+        }
+        // the value when the iterator got to the node
+        const V& value() const {
+            return _value->value;
+        }
+    private:
+        // seek and next, expired and removing keys included
+        void seek_any(const K& key);
+        void step();
+        void skip_dead();
+        // protect the value of _cur
+        void load_value();
+
+        SkipList<K, V>* _list;
+        Node<K, V>* _cur;
+        ValueBlock<V>* _value = nullptr;
+        reclaim::Guard<void> _guard;
+        // guard slot holding _cur, the other node slot takes the next node
+        int _cur_slot = 0;
+        static const int VALUE_SLOT = 2;
+    };
+
+    // any key can be stored, the footer is told apart by address and its
+    // key is never compared
+    explicit SkipList(reclaim::Policy policy = reclaim::EPOCH)
+        : _rnd(0x12345678)
+        , _pool(Node<K, V>::size_of(1), Node<K, V>::LEVEL_SIZE, MAX_LEVEL)
+        , _reclaimer(policy, [this](void* p, int kind) { reclaim(p, kind); }) {
+        create_list();
     }
     virtual ~SkipList() {
+        _reclaimer.free_all();
         free_list();
     }
     
-    bool search(const K& key, V& value);
-    bool insert(K key, V value);
+    bool search(const K& key, V& value) {
+        return lookup(key, value, true);
+    }
+    // a search that leaves the key unmarked for eviction, for lookups made
+    // on behalf of the list itself rather than a client
+    bool peek(const K& key, V& value) {
+        return lookup(key, value, false);
+    }
+    // Look up keys sorted in increasing order, each search resumes from
+    // the fingers of the previous one. Returns how many were found.
+    int multi_search(const std::vector<K>& keys, std::vector<V>& values,
+            std::vector<bool>& found);
+    // expire_ms is the wall clock ms the key expires at, 0 for never. An
+    // expired key is a miss for readers and is unlinked by expire.
+    // Writer only, unless concurrent writes are enabled.
+    bool insert(K key, V value, uint64_t expire_ms = 0);
+    // false if the key is missing or expired, an expired one is unlinked
+    // anyway
     bool remove(K key, V& value);
-    void dump(std::string path);
-    bool load(std::string path);
+    // Swap the value of a live key for one the caller moved, e.g. to
+    // another file. Keeps its expire time, neither marks the key for
+    // eviction nor schedules it again. Writer only, false if the key is
+    // missing or expired.
+    bool replace_value(const K& key, const V& value);
+    // Unlink expired keys, called by the writer. Handles at most max of
+    // the keys due, so that a burst of expirations is spread over several
+    // calls. Returns the keys unlinked.
+    size_t expire(size_t max);
+    // write a binary snapshot, sequence is stored as is in its header
+    bool dump(std::string path, uint64_t sequence = 0);
+    // load a snapshot, an empty list is built bottom up in one pass. Fails
+    // if the snapshot was written with other snapshot flags.
+    bool load(std::string path, uint64_t* sequence = nullptr);
+    // Stored in the header of every snapshot, tells how the values are
+    // encoded, e.g. tagged by a value log. 0 by default. Call before load.
+    void set_snapshot_flags(uint32_t flags) {
+        _snapshot_flags = flags;
+    }
+
+    // Freeze the current content for an online dump, must be called by the
+    // writer. Returns false if a snapshot is already running.
+    bool begin_snapshot();
+    // Dump the content frozen by begin_snapshot while the writer goes on,
+    // may run on any thread. Ends the snapshot whatever the result.
+    bool dump_snapshot(std::string path, uint64_t sequence);
     
     int size() {
-        return _size;
+        return _size.load(std::memory_order_relaxed);
+    }
+    // levels in use, the height of a search
+    int level() const {
+        return _level;
+    }
+    // bytes of the keys and values in the list, replaced and removed
+    // values not freed yet are not counted
+    int64_t key_bytes() const {
+        return _key_bytes.load(std::memory_order_relaxed);
+    }
+    int64_t value_bytes() const {
+        return _value_bytes.load(std::memory_order_relaxed);
+    }
+
+    // Free removed and replaced nodes on a thread of their own instead of
+    // in the writer, call from the writer
+    void start_background_gc() {
+        _reclaimer.start_thread();
+    }
+    // removed or replaced nodes not freed yet
+    size_t gc_backlog() const {
+        return _reclaimer.backlog();
+    }
+    // of those, the ones readers kept at the last gc pass
+    size_t gc_pinned() const {
+        return _reclaimer.pinned();
+    }
+    // per thread reader records (epochs or hazard slots) ever taken
+    size_t gc_reader_slots() const {
+        return _reclaimer.reader_slots();
+    }
+    // keys put with an expire time that expire has not handled yet,
+    // including the ones updated or removed since
+    int64_t ttl_keys() const {
+        return _ttl_keys.load(std::memory_order_relaxed);
+    }
+    // keys already due but left by the last expire call
+    size_t expire_backlog() const {
+        return _expiring.size() - _expiring_pos;
+    }
+
+    // Bound memory_bytes(): once an insert goes over bytes, the writer
+    // evicts keys not searched lately (CLOCK) until it is under again.
+    // 0 means no limit. Call before the list is shared with readers.
+    void set_memory_limit(size_t bytes) {
+        // the hand has a single writer to follow
+        if (!_concurrent) {
+            _memory_limit = bytes;
+        }
+    }
+    // bytes of the nodes, value blocks, keys and values in the list, and
+    // of the hash index
+    int64_t memory_bytes() const {
+        return _key_bytes.load(std::memory_order_relaxed)
+            + _value_bytes.load(std::memory_order_relaxed)
+            + _node_bytes.load(std::memory_order_relaxed)
+            + (_index ? _index->bytes() : 0);
+    }
+    // keys evicted for the memory limit
+    int64_t evicted() const {
+        return _evicted.load(std::memory_order_relaxed);
+    }
+
+    // Put a counting bloom filter sized for expected_keys in front of
+    // search, filled from the current content. Call before the list is
+    // shared with readers; load sizes it up for a bigger snapshot.
+    void enable_bloom_filter(size_t expected_keys);
+
+    // Keep a hash index from key to node, sized for expected_keys, so that
+    // search costs a probe or two instead of a descent; the list stays the
+    // source of order. Grows by itself. Call before the list is shared
+    // with readers, single writer only.
+    void enable_hash_index(size_t expected_keys);
+
+    // Let any thread insert, update and remove: nodes are linked bottom up
+    // with CAS and a remove marks the node's pointers before unlinking it,
+    // see insert_concurrent. Call on an empty list before it is shared.
+    // Needs the epoch policy and starts the reclaimer thread. The bloom
+    // filter, the hash index, the memory limit, online snapshots and
+    // expire are writer only and stay off: expired keys are still misses, but are only
+    // unlinked by a remove. Returns false if the list cannot switch.
+    bool enable_concurrent_writes();
+    bool concurrent_writes() const {
+        return _concurrent;
+    }
+
+    // Called by the writer with every value that leaves the list, replaced
+    // or removed (expired and evicted keys included), e.g. to release what
+    // the value refers to. Single writer only.
+    void set_drop_handler(std::function<void(const V&)> handler) {
+        _drop_handler = std::move(handler);
+    }
+    // f(key, value) for every key in order, expired ones included. Writer
+    // only.
+    template<typename F>
+    void for_each(F f) {
+        for (Node<K, V>* x = _header->next_relaxed(0); x != _footer; x = x->next_relaxed(0)) {
+            f(x->key, x->value.load(std::memory_order_relaxed)->value);
+        }
     }
 
 private:
-    void create_list(K footerKey);
+    void create_list();
 
     void free_list();
 
     void create_node(int level, Node<K, V>* &node);
     
-    void create_node(int level, Node<K, V>* &node, K key, V value);
+    void create_node(int level, Node<K, V>* &node, K key, V value, uint64_t expire_ms);
+
+    // a block for a value written now
+    ValueBlock<V>* new_value(const V& value, uint64_t expire_ms) {
+        return new ValueBlock<V>(value, bump<uint64_t>(_version, 1), expire_ms);
+    }
+    // a counter only the writer changes, plain load and store are enough,
+    // concurrent writers add atomically. Returns the new value.
+    template<typename T>
+    T bump(std::atomic<T>& counter, T delta) {
+        if (_concurrent) {
+            return counter.fetch_add(delta, std::memory_order_relaxed) + delta;
+        }
+        T value = counter.load(std::memory_order_relaxed) + delta;
+        counter.store(value, std::memory_order_relaxed);
+        return value;
+    }
+    bool insert_concurrent(const K& key, const V& value, uint64_t expire_ms);
+    bool remove_concurrent(const K& key, V& value);
+    // Fill preds and succs on every level around key for a concurrent
+    // writer, unlinking the marked nodes met on the way. True if succs[0]
+    // holds key. Must run in a reader section.
+    bool find_for_write(const K& key, Node<K, V>** preds, Node<K, V>** succs);
+    // raise _level to at least level, concurrent writers never lower it
+    void raise_level(int level);
+    // hand a key with an expire time to _ttl
+    void schedule_expire(const K& key, uint64_t expire_ms);
+    // node is still after prev, checked once node is published. An
+    // unlinked prev keeps pointing to a node that may be retired since.
+    static bool still_linked(Node<K, V>* prev, Node<K, V>* node) {
+        return prev->next_relaxed(0) == node && !prev->unlinked.load();
+    }
+    // the current value of node, which the guard protects already
+    static ValueBlock<V>* load_value(Node<K, V>* node, reclaim::Guard<void>& guard, int slot);
+
+    // give the node block back to _pool, or to the heap under concurrent
+    // writes
+    void destroy_node(Node<K, V>* node);
+    void* allocate_node(int level);
+    // free what _reclaimer retired, may run on the reclaimer thread
+    void reclaim(void* p, int kind);
     
     int get_random_level();
     
     Node<K, V>* find_greater_or_equal(const K& key, Node<K,V>** prev);
+    // descend from prev[level] instead of the header, prev[level] must be
+    // before key
+    Node<K, V>* find_greater_or_equal(const K& key, Node<K,V>** prev, int level);
     
-    void defer_free(Node<K, V>* node);
+    // legacy text dump written by older versions
+    bool load_text(std::string path);
+
+    // keep what a running snapshot still has to see of a node about to be
+    // unlinked or replaced
+    void preserve(Node<K, V>* node);
+
+    enum RetiredKind {
+        RETIRED_NODE,
+        RETIRED_VALUE,
+        // a hash index table replaced by a bigger one
+        RETIRED_INDEX_TABLE,
+    };
+    void defer_free(void* p, int kind);
     
-    void haz_gc();
+    void gc();
+
+    void add_bytes(int64_t keys, int64_t values) {
+        bump(_key_bytes, keys);
+        bump(_value_bytes, values);
+    }
+    // a node of level and its value block
+    void add_node_bytes(int level, int sign) {
+        bump<int64_t>(_node_bytes, sign * static_cast<int64_t>(
+                    _pool.block_size(level - 1) + sizeof(ValueBlock<V>)));
+    }
+    // search marks what it finds for the eviction hand
+    void touch(Node<K, V>* node) {
+        if (_memory_limit != 0 && !node->referenced.load(std::memory_order_relaxed)) {
+            node->referenced.store(true, std::memory_order_relaxed);
+        }
+    }
+    // remove keys under the clock hand until the list fits in _memory_limit
+    void evict();
+
+    void update_ttl_keys() {
+        _ttl_keys.store(static_cast<int64_t>((_ttl ? _ttl->size() : 0) + expire_backlog()),
+                std::memory_order_relaxed);
+    }
+
+    // new filter holding the current keys, only while no reader runs
+    void rebuild_bloom_filter(size_t expected_keys);
+    // same for the hash index
+    void rebuild_hash_index(size_t expected_keys);
+    void index_add(uint64_t hash, Node<K, V>* node) {
+        auto* old = _index->insert(hash, node);
+        if (old != nullptr) {
+            defer_free(old, RETIRED_INDEX_TABLE);
+        }
+    }
+    // hash for the bloom filter and the hash index, if any
+    uint64_t key_hash(const K& key) const {
+        return (_bloom || _index) ? bloom_hash(key) : 0;
+    }
+    // mark touches the key for the eviction hand
+    bool lookup(const K& key, V& value, bool mark);
+    bool search_index(const K& key, uint64_t hash, V& value, bool mark);
 
     Node<K, V>* _header;
     Node<K, V>* _footer;
-    int _level; //level scope [1, MAX_LEVEL]
-    int _size;
+    std::atomic<int> _level; //level scope [1, MAX_LEVEL]
+    std::atomic<int> _size;
+    std::atomic<int64_t> _key_bytes{0};
+    std::atomic<int64_t> _value_bytes{0};
+    std::atomic<int64_t> _node_bytes{0};
+    size_t _memory_limit = 0;
+    // next node the eviction hand looks at, null for the first one. remove
+    // moves it on when it unlinks that node.
+    Node<K, V>* _clock_hand = nullptr;
+    std::atomic<int64_t> _evicted{0};
+    // see set_drop_handler
+    std::function<void(const V&)> _drop_handler;
+    uint32_t _snapshot_flags = 0;
     Random _rnd;
     static const int MAX_LEVEL = 16;
+    // nodes of level l come from class l - 1
+    NodePool _pool;
     static const int GC_THRESHOLD = 50;
-    hp::HazardPointerList<Node<K, V>> _all_haz_points;
-    std::vector<Node<K, V>*> _lazy_trash_queue;
+    static const uint64_t TTL_TICK_MS = 10;
+    // unlinked nodes and replaced value blocks
+    reclaim::Reclaimer<void> _reclaimer;
+    // null when disabled, maintained by the writer, read by search
+    std::unique_ptr<BloomFilter> _bloom;
+    size_t _bloom_keys = 0;
+    // null when disabled, like the filter
+    typedef HashIndex<K, Node<K, V>> Index;
+    std::unique_ptr<Index> _index;
+    size_t _index_keys = 0;
+    // keys with an expire time, created by the first one. Only the writer
+    // touches them.
+    std::unique_ptr<TimerWheel<K>> _ttl;
+    // due keys, the ones before _expiring_pos are handled
+    std::vector<typename TimerWheel<K>::Entry> _expiring;
+    size_t _expiring_pos = 0;
+    std::atomic<int64_t> _ttl_keys{0};
+
+    // bumped by every value written, values newer than _snapshot_version
+    // are not part of a running snapshot
+    std::atomic<uint64_t> _version{0};
+    // several writers, see enable_concurrent_writes
+    bool _concurrent = false;
+    // a snapshot is running, nodes are not freed until it ends
+    std::atomic<bool> _snapshot_active{false};
+    uint64_t _snapshot_version = 0;
+    // guards the fields below, shared by the writer and the snapshot thread
+    std::mutex _snapshot_mutex;
+    // last key written by the snapshot, valid once _snapshot_started
+    bool _snapshot_started = false;
+    K _snapshot_cursor;
+    // frozen entries the writer removed before the snapshot got to them
+    std::map<K, ValueBlock<V>> _preserved;
 };
 
 template<typename K, typename V>
-void SkipList<K, V>::create_list(K footerKey) {
+void SkipList<K, V>::create_list() {
     create_node(1, _footer);
-    _footer->key = footerKey;
     _footer->set_next(0, nullptr);
 
     create_node(MAX_LEVEL, _header);
     for (int i = 0; i < MAX_LEVEL; ++i) {
+        if (i > 0) {
+            // the footer is above every key
+            _header->set_next_prefix(i, UINT64_MAX);
+        }
         _header->set_next(i, _footer);
     }
     
     _level = 1;
     _size = 0;
+    _key_bytes.store(0, std::memory_order_relaxed);
+    _value_bytes.store(0, std::memory_order_relaxed);
+    _node_bytes.store(0, std::memory_order_relaxed);
+    _clock_hand = nullptr;
+}
+
+template<typename K, typename V>
+void* SkipList<K, V>::allocate_node(int level) {
+    // the pool has one allocating thread
+    if (_concurrent) {
+        return ::operator new(Node<K, V>::size_of(level));
+    }
+    return _pool.allocate(level - 1);
 }
 
 template<typename K, typename V>
 void SkipList<K, V>::create_node(int level, Node<K, V> *&node) {
-    node = new Node<K, V>();
     assert(level > 0);
-    node->level = level;
-    node->forward = new std::atomic<Node<K, V>*>[level];
-    assert(node != NULL);
+    node = new (allocate_node(level)) Node<K, V>(level);
 }
 
 template<typename K, typename V>
-void SkipList<K, V>::create_node(int level, Node<K, V> *&node, K key, V value) {
-    node = new Node<K, V>(key, value);
+void SkipList<K, V>::create_node(int level, Node<K, V> *&node, K key, V value,
+        uint64_t expire_ms) {
     assert(level > 0);
-    node->level = level;
-    node->forward = new std::atomic<Node<K, V>*>[level];
-    assert(node != NULL);
+    node = new (allocate_node(level)) Node<K, V>(level, key, new_value(value, expire_ms));
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::destroy_node(Node<K, V>* node) {
+    int level = node->level;
+    node->~Node<K, V>();
+    if (_concurrent) {
+        ::operator delete(node);
+        return;
+    }
+    _pool.deallocate(node, level - 1);
+}
+
+template<typename K, typename V>
+ValueBlock<V>* SkipList<K, V>::load_value(Node<K, V>* node, reclaim::Guard<void>& guard, int slot) {
+    // same protocol as for nodes: publish, then check it is still current
+    ValueBlock<V>* v;
+    do {
+        v = node->value.load(std::memory_order_acquire);
+        guard.protect(v, slot);
+    } while (node->value.load(std::memory_order_acquire) != v);
+    return v;
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::reclaim(void* p, int kind) {
+    if (kind == RETIRED_VALUE) {
+        delete static_cast<ValueBlock<V>*>(p);
+        return;
+    }
+    if (kind == RETIRED_INDEX_TABLE) {
+        delete static_cast<typename Index::Table*>(p);
+        return;
+    }
+    Node<K, V>* node = static_cast<Node<K, V>*>(p);
+    int level = node->level;
+    node->~Node<K, V>();
+    if (_concurrent) {
+        ::operator delete(node);
+    } else if (_reclaimer.background()) {
+        _pool.deallocate_remote(node, level - 1);
+    } else {
+        _pool.deallocate(node, level - 1);
+    }
 }
 
 template<typename K, typename V>
@@ -182,111 +703,548 @@ void SkipList<K, V>::free_list() {
     Node<K, V> *p = _header;
     Node<K, V> *q;
     while (p != NULL) {
-        q = p->forward[0];
-        delete p;
+        q = p->next_relaxed(0);
+        destroy_node(p);
         p = q;
     }
 }
 
 template<typename K, typename V>
-bool SkipList<K, V>::search(const K& key, V& value) {
+bool SkipList<K, V>::lookup(const K& key, V& value, bool mark) {
     Node<K, V>* prev[MAX_LEVEL];
     Node<K, V>* result;
+    uint64_t hash = key_hash(key);
+    if (_bloom && !_bloom->may_contain(hash)) {
+        return false;
+    }
+    if (_index) {
+        return search_index(key, hash, value, mark);
+    }
     // need to mark point before use, after that also need to check the point is
     // available
     // think about this senario:
     // 1. point been removed by other thread
     // 2. point then been marked
     // 3. then try to use unavailable point
-    auto haz_point = _all_haz_points.acquire();
+    reclaim::Guard<void> guard(&_reclaimer);
     do {
         result = find_greater_or_equal(key, prev);
-        haz_point->remember(result);
-    } while (prev[0]->next_relaxed(0) != result);
+        guard.protect(result);
+    } while (!still_linked(prev[0], result));
     
-    if (result != nullptr && result->key == key) {
-        value = result->value;
-        haz_point->release();
+    if (result != _footer && result->key == key) {
+        ValueBlock<V>* block = load_value(result, guard, 1);
+        // a marked node is removed, it may still be reached through
+        // another node being removed
+        if (block->expired() || result->marked()) {
+            return false;
+        }
+        value = block->value;
+        if (mark) {
+            touch(result);
+        }
         return true;
     }
-    haz_point->release();
     return false;
 }
 
 template<typename K, typename V>
-bool SkipList<K, V>::insert(K key, V value) {
-    bool update = false;
+bool SkipList<K, V>::search_index(const K& key, uint64_t hash, V& value, bool mark) {
+    // node in slot 0, its value in 1 and the index table in 2
+    reclaim::Guard<void> guard(&_reclaimer);
+    Node<K, V>* result = _index->find(hash, key, guard, 0, 2);
+    if (result == nullptr) {
+        return false;
+    }
+    ValueBlock<V>* block = load_value(result, guard, 1);
+    if (block->expired()) {
+        return false;
+    }
+    value = block->value;
+    if (mark) {
+        touch(result);
+    }
+    return true;
+}
+
+template<typename K, typename V>
+int SkipList<K, V>::multi_search(const std::vector<K>& keys, std::vector<V>& values,
+        std::vector<bool>& found) {
+    values.resize(keys.size());
+    found.assign(keys.size(), false);
+    if (keys.empty()) {
+        return 0;
+    }
+    // fingers are kept between keys, pin every node for the whole batch
+    reclaim::Guard<void> guard(&_reclaimer);
+    guard.protect_all();
     Node<K, V>* prev[MAX_LEVEL];
-    Node<K, V>* result = find_greater_or_equal(key, prev);
+    int top = _level - 1;
+    int cnt = 0;
+    Node<K, V>* result = find_greater_or_equal(keys[0], prev);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        // fingers stay where they are for a filtered key
+        if (_bloom && !_bloom->may_contain(bloom_hash(keys[i]))) {
+            continue;
+        }
+        if (i > 0) {
+            // the lowest level whose finger span still covers the key, the
+            // spans of the levels above cover it as well
+            int level = 0;
+            while (level < top && prev[level]->next(level) != _footer
+                    && prev[level]->next(level)->key < keys[i]) {
+                ++level;
+            }
+            if (prev[level]->unlinked.load()) {
+                result = find_greater_or_equal(keys[i], prev);
+                top = _level - 1;
+            } else {
+                result = find_greater_or_equal(keys[i], prev, level);
+            }
+        }
+        if (result != _footer && result->key == keys[i]) {
+            ValueBlock<V>* block = result->value.load(std::memory_order_acquire);
+            if (!block->expired() && !result->marked()) {
+                values[i] = block->value;
+                found[i] = true;
+                touch(result);
+                ++cnt;
+            }
+        }
+    }
+    return cnt;
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::Iterator::seek(const K& key) {
+    seek_any(key);
+    skip_dead();
+}
 
-    if (nullptr != result && result->key == key) {
-        update = true;
+template<typename K, typename V>
+void SkipList<K, V>::Iterator::next() {
+    step();
+    skip_dead();
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::Iterator::skip_dead() {
+    while (valid() && (_value->expired() || _cur->marked())) {
+        step();
     }
-    
-    int node_level = result->level;
-    if (!update) {
-        node_level = get_random_level();
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::Iterator::seek_any(const K& key) {
+    Node<K, V>* prev[MAX_LEVEL];
+    // same protocol as search: publish, then check it is still linked
+    do {
+        _cur = _list->find_greater_or_equal(key, prev);
+        _guard.protect(_cur, _cur_slot);
+    } while (!still_linked(prev[0], _cur));
+    load_value();
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::Iterator::load_value() {
+    _value = valid() ? SkipList<K, V>::load_value(_cur, _guard, VALUE_SLOT) : nullptr;
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::Iterator::step() {
+    while (true) {
+        Node<K, V>* next = _cur->next(0);
+        _guard.protect(next, 1 - _cur_slot);
+        // _cur is pinned. If it is still linked and still points to next
+        // after next got published, next was linked too at that time and
+        // the writer will see it protected before freeing it.
+        if (!_cur->unlinked.load() && _cur->next(0) == next) {
+            _cur = next;
+            _cur_slot = 1 - _cur_slot;
+            _guard.protect(nullptr, 1 - _cur_slot);
+            load_value();
+            return;
+        }
+        if (_cur->unlinked.load()) {
+            // the successor of an unlinked node may be gone, search again
+            // for the first key after the current one
+            K last = _cur->key;
+            seek_any(last);
+            if (valid() && !(last < _cur->key)) {
+                continue;
+            }
+            return;
+        }
+    }
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::schedule_expire(const K& key, uint64_t expire_ms) {
+    // the wheel has a single owner, concurrent writers leave expired keys
+    // to readers, which skip them
+    if (_concurrent) {
+        return;
+    }
+    if (!_ttl) {
+        _ttl.reset(new TimerWheel<K>(TTL_TICK_MS, wall_time_ms()));
+    }
+    _ttl->add(expire_ms, key);
+    update_ttl_keys();
+}
+
+template<typename K, typename V>
+bool SkipList<K, V>::insert(K key, V value, uint64_t expire_ms) {
+    if (_concurrent) {
+        return insert_concurrent(key, value, expire_ms);
+    }
+    Node<K, V>* prev[MAX_LEVEL];
+    Node<K, V>* result = find_greater_or_equal(key, prev);
+    if (expire_ms != 0) {
+        schedule_expire(key, expire_ms);
+    }
+
+    if (result != _footer && result->key == key) {
+        // an update only swaps the value, readers see the old or the new
+        // block and the node keeps its links
+        preserve(result);
+        ValueBlock<V>* old = result->value.load(std::memory_order_relaxed);
+        result->value.store(new_value(value, expire_ms), std::memory_order_release);
+        add_bytes(0, static_cast<int64_t>(payload_size(value))
+                - static_cast<int64_t>(payload_size(old->value)));
+        if (_drop_handler) {
+            _drop_handler(old->value);
+        }
+        defer_free(old, RETIRED_VALUE);
+        result->referenced.store(true, std::memory_order_relaxed);
+        if (_memory_limit != 0 && memory_bytes() > static_cast<int64_t>(_memory_limit)) {
+            evict();
+        }
+        return true;
     }
     
+    int node_level = get_random_level();
     if (node_level > _level) {
         for (int i = _level; i < node_level; ++i) {
             prev[i] = _header;
         }
-        _level = node_level;
+        _level.store(node_level, std::memory_order_relaxed);
     }
     
+    uint64_t hash = key_hash(key);
+    if (_bloom) {
+        // counted before the node is visible, so no reader misses it
+        _bloom->add(hash);
+    }
     Node<K, V>* new_node;
-    create_node(node_level, new_node, key, value);
+    create_node(node_level, new_node, key, value, expire_ms);
+    uint64_t prefix = key_prefix(key);
     for (int i = 0; i < node_level; ++i) {
-        if (update) {
-            new_node->set_next_relaxed(i, result->next_relaxed(i));
-        } else {
-            new_node->set_next_relaxed(i, prev[i]->next_relaxed(i));
+        new_node->set_next_relaxed(i, prev[i]->next_relaxed(i));
+        if (i > 0) {
+            new_node->set_next_prefix(i, prev[i]->next_prefix(i));
+            prev[i]->set_next_prefix(i, prefix);
         }
         prev[i]->set_next(i, new_node);
     }
+    if (_index) {
+        index_add(hash, new_node);
+    }
+    bump(_size, 1);
+    add_bytes(payload_size(key), payload_size(value));
+    add_node_bytes(node_level, 1);
+    // a new key gets a whole turn of the hand before it can go
+    new_node->referenced.store(true, std::memory_order_relaxed);
+    if (_memory_limit != 0 && memory_bytes() > static_cast<int64_t>(_memory_limit)) {
+        evict();
+    }
+    return true;
+}
 
-    if (!update) {
-        ++_size;
-    } else {
-        defer_free(result);
+template<typename K, typename V>
+bool SkipList<K, V>::replace_value(const K& key, const V& value) {
+    if (_concurrent) {
+        return false;
+    }
+    Node<K, V>* prev[MAX_LEVEL];
+    Node<K, V>* result = find_greater_or_equal(key, prev);
+    if (result == _footer || result->key != key) {
+        return false;
     }
+    ValueBlock<V>* old = result->value.load(std::memory_order_relaxed);
+    if (old->expired()) {
+        return false;
+    }
+    preserve(result);
+    result->value.store(new_value(value, old->expire_ms), std::memory_order_release);
+    add_bytes(0, static_cast<int64_t>(payload_size(value))
+            - static_cast<int64_t>(payload_size(old->value)));
+    if (_drop_handler) {
+        _drop_handler(old->value);
+    }
+    defer_free(old, RETIRED_VALUE);
     return true;
 }
 
 template<typename K, typename V>
 bool SkipList<K, V>::remove(K key, V &value) {
+    if (_concurrent) {
+        return remove_concurrent(key, value);
+    }
     Node<K, V>* prev[MAX_LEVEL];
     Node<K, V>* result = find_greater_or_equal(key, prev);
 
-    if (nullptr != result && result->key != key) {
+    if (result == _footer || result->key != key) {
         return false;
     }
 
+    preserve(result);
     for (int i = 0; i < _level; ++i) {
         if (prev[i]->next_relaxed(i) != result) {
             continue;
         }
         prev[i]->set_next(i, result->next_relaxed(i));
+        if (i > 0) {
+            prev[i]->set_next_prefix(i, result->next_prefix(i));
+        }
+    }
+    ValueBlock<V>* block = result->value.load(std::memory_order_relaxed);
+    bool live = !block->expired();
+    value = block->value;
+    if (_drop_handler) {
+        _drop_handler(value);
+    }
+    result->unlinked.store(true);
+    add_bytes(-static_cast<int64_t>(payload_size(key)),
+            -static_cast<int64_t>(payload_size(value)));
+    add_node_bytes(result->level, -1);
+    if (_clock_hand == result) {
+        _clock_hand = result->next_relaxed(0);
+    }
+    uint64_t hash = key_hash(key);
+    if (_bloom) {
+        _bloom->remove(hash);
+    }
+    if (_index) {
+        // out of the index before it is retired, see HashIndex::find
+        _index->erase(hash, result);
     }
-    value = result->value;
     // defer free point, to make sure all read is finished
-    defer_free(result);
+    defer_free(result, RETIRED_NODE);
 
     while (_level > 1
             && _header->next_relaxed(_level - 1) == _footer) {
-        _level--;
+        _level.store(_level.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    }
+
+    bump(_size, -1);
+    return live;
+}
+
+template<typename K, typename V>
+bool SkipList<K, V>::find_for_write(const K& key, Node<K, V>** preds, Node<K, V>** succs) {
+retry:
+    int top = _level.load(std::memory_order_acquire) - 1;
+    for (int i = MAX_LEVEL - 1; i > top; --i) {
+        preds[i] = _header;
+        succs[i] = _header->next(i);
+    }
+    Node<K, V>* pred = _header;
+    for (int i = top; i >= 0; --i) {
+        Node<K, V>* cur = pred->next(i);
+        while (cur != _footer) {
+            Node<K, V>* succ = cur->next_marked(i);
+            if (Node<K, V>::is_marked(succ)) {
+                // cur is being removed, take it out of this level. A failed
+                // CAS means pred changed or is being removed itself.
+                Node<K, V>* expected = cur;
+                if (!pred->cas_next(i, expected, Node<K, V>::unmarked(succ))) {
+                    goto retry;
+                }
+                cur = Node<K, V>::unmarked(succ);
+                continue;
+            }
+            if (!(cur->key < key)) {
+                break;
+            }
+            pred = cur;
+            cur = succ;
+        }
+        preds[i] = pred;
+        succs[i] = cur;
     }
+    return succs[0] != _footer && succs[0]->key == key;
+}
 
-    --_size;
+template<typename K, typename V>
+void SkipList<K, V>::raise_level(int level) {
+    int cur = _level.load(std::memory_order_relaxed);
+    while (cur < level && !_level.compare_exchange_weak(cur, level,
+                std::memory_order_release, std::memory_order_relaxed)) {
+    }
+}
+
+template<typename K, typename V>
+bool SkipList<K, V>::insert_concurrent(const K& key, const V& value, uint64_t expire_ms) {
+    // every node reached stays allocated until the guard goes away
+    reclaim::Guard<void> guard(&_reclaimer);
+    Node<K, V>* preds[MAX_LEVEL];
+    Node<K, V>* succs[MAX_LEVEL];
+    Node<K, V>* node = nullptr;
+    while (true) {
+        if (find_for_write(key, preds, succs)) {
+            // an update swaps the value like the single writer does, a
+            // remove claiming the node meanwhile wins over it
+            ValueBlock<V>* old = succs[0]->value.exchange(new_value(value, expire_ms),
+                    std::memory_order_acq_rel);
+            add_bytes(0, static_cast<int64_t>(payload_size(value))
+                    - static_cast<int64_t>(payload_size(old->value)));
+            defer_free(old, RETIRED_VALUE);
+            if (node != nullptr) {
+                // lost the race to link the key
+                destroy_node(node);
+            }
+            return true;
+        }
+        if (node == nullptr) {
+            create_node(get_random_level(), node, key, value, expire_ms);
+            node->fully_linked.store(false, std::memory_order_relaxed);
+        }
+        for (int i = 0; i < node->level; ++i) {
+            node->set_next_relaxed(i, succs[i]);
+        }
+        // linked at level 0 the key is in the list
+        Node<K, V>* expected = succs[0];
+        if (preds[0]->cas_next(0, expected, node)) {
+            break;
+        }
+    }
+    // searches may start from the new levels before they are linked, the
+    // header points past them
+    raise_level(node->level);
+    for (int i = 1; i < node->level; ++i) {
+        while (true) {
+            Node<K, V>* expected = succs[i];
+            if (preds[i]->cas_next(i, expected, node)) {
+                break;
+            }
+            // remove waits for fully_linked, the node cannot be claimed
+            find_for_write(key, preds, succs);
+            node->set_next(i, succs[i]);
+        }
+    }
+    node->fully_linked.store(true, std::memory_order_release);
+    bump(_size, 1);
+    add_bytes(payload_size(key), payload_size(value));
+    add_node_bytes(node->level, 1);
     return true;
 }
 
+template<typename K, typename V>
+bool SkipList<K, V>::remove_concurrent(const K& key, V& value) {
+    reclaim::Guard<void> guard(&_reclaimer);
+    Node<K, V>* preds[MAX_LEVEL];
+    Node<K, V>* succs[MAX_LEVEL];
+    if (!find_for_write(key, preds, succs)) {
+        return false;
+    }
+    Node<K, V>* node = succs[0];
+    // an insert is still linking the node, it only takes a few CAS
+    while (!node->fully_linked.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+    for (int i = node->level - 1; i > 0; --i) {
+        Node<K, V>* succ = node->next_marked(i);
+        while (!Node<K, V>::is_marked(succ)
+                && !node->cas_next(i, succ, Node<K, V>::with_mark(succ))) {
+        }
+    }
+    // the remove that marks level 0 owns the node
+    Node<K, V>* succ = node->next_marked(0);
+    while (true) {
+        if (Node<K, V>::is_marked(succ)) {
+            return false;
+        }
+        if (node->cas_next(0, succ, Node<K, V>::with_mark(succ))) {
+            break;
+        }
+    }
+    ValueBlock<V>* block = node->value.load(std::memory_order_acquire);
+    bool live = !block->expired();
+    value = block->value;
+    // unlinks the node from every level, it is the first key >= key on
+    // each one and marked
+    find_for_write(key, preds, succs);
+    node->unlinked.store(true);
+    bump(_size, -1);
+    add_bytes(-static_cast<int64_t>(payload_size(key)),
+            -static_cast<int64_t>(payload_size(value)));
+    add_node_bytes(node->level, -1);
+    defer_free(node, RETIRED_NODE);
+    return live;
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::evict() {
+    // two turns at most, every reference bit is clear after the first
+    int64_t steps = 2 * static_cast<int64_t>(_size.load());
+    V value;
+    while (memory_bytes() > static_cast<int64_t>(_memory_limit) && _size.load() > 0 && steps-- > 0) {
+        Node<K, V>* node = _clock_hand;
+        if (node == nullptr || node == _footer) {
+            node = _header->next_relaxed(0);
+        }
+        _clock_hand = node->next_relaxed(0);
+        // expired keys go first whatever their bit
+        if (!node->value.load(std::memory_order_relaxed)->expired()
+                && node->referenced.load(std::memory_order_relaxed)) {
+            node->referenced.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        // unlinked like any remove, readers holding it are safe
+        K key = node->key;
+        remove(key, value);
+        _evicted.store(_evicted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+template<typename K, typename V>
+size_t SkipList<K, V>::expire(size_t max) {
+    if (!_ttl) {
+        return 0;
+    }
+    if (_expiring_pos == _expiring.size()) {
+        _expiring.clear();
+        _expiring_pos = 0;
+        _ttl->advance(wall_time_ms(), &_expiring);
+    }
+    size_t removed = 0;
+    size_t end = std::min(_expiring.size(), _expiring_pos + max);
+    Node<K, V>* prev[MAX_LEVEL];
+    V value;
+    for (; _expiring_pos < end; ++_expiring_pos) {
+        const auto& entry = _expiring[_expiring_pos];
+        Node<K, V>* result = find_greater_or_equal(entry.item, prev);
+        // the key may be gone, or updated with another expire time
+        if (result == _footer || result->key != entry.item
+                || result->value.load(std::memory_order_relaxed)->expire_ms != entry.expire_ms) {
+            continue;
+        }
+        remove(entry.item, value);
+        ++removed;
+    }
+    update_ttl_keys();
+    return removed;
+}
+
 template<typename K, typename V>
 int SkipList<K, V>::get_random_level() {
     static const unsigned int prob_level = 4;
+    // one generator per writer thread under concurrent writes
+    static thread_local Random thread_rnd(
+            static_cast<uint32_t>(std::hash<std::thread::id>()(std::this_thread::get_id())));
+    Random& rnd = _concurrent ? thread_rnd : _rnd;
     int level = 1;
-    while (level < MAX_LEVEL && ((_rnd.next() % prob_level) == 0)) {
+    while (level < MAX_LEVEL && ((rnd.next() % prob_level) == 0)) {
       level++;
     }
     return level;
@@ -294,11 +1252,36 @@ int SkipList<K, V>::get_random_level() {
 
 template<typename K, typename V>
 Node<K, V>* SkipList<K, V>::find_greater_or_equal(const K& key, Node<K,V>** prev) {
+    return find_greater_or_equal(key, prev, -1);
+}
+
+template<typename K, typename V>
+Node<K, V>* SkipList<K, V>::find_greater_or_equal(const K& key, Node<K,V>** prev, int level) {
     Node<K, V>* x = _header;
     int index = _level - 1;
+    if (level >= 0) {
+        x = prev[level];
+        index = level;
+    }
+    // the prefixes next to the forward pointers are only kept by the
+    // single writer
+    const bool use_prefix = !_concurrent;
+    const uint64_t prefix = key_prefix(key);
     while(true) {
+        if (use_prefix && index > 0 && prefix < x->next_prefix(index)) {
+            // the next node is above the key, go down without touching it
+            if (nullptr != prev) prev[index] = x;
+            index--;
+            continue;
+        }
         Node<K, V>* next = x->next(index);
-        if ((nullptr != next) && (next->key < key)) {
+        if (index == 1
+                || (index > 1 && (!use_prefix || prefix >= x->next_prefix(index - 1)))) {
+            // the node a level down is loaded if next is not below the key,
+            // fetch it while next is compared
+            __builtin_prefetch(x->next_relaxed(index - 1));
+        }
+        if (next != _footer && next->key < key) {
             x = next;
         } else {
             if (nullptr != prev) prev[index] = x;
@@ -312,30 +1295,154 @@ Node<K, V>* SkipList<K, V>::find_greater_or_equal(const K& key, Node<K,V>** prev
 }
 
 template<typename K, typename V>
-void SkipList<K, V>::dump(std::string path) {
-    std::ofstream out(path);
+bool SkipList<K, V>::dump(std::string path, uint64_t sequence) {
+    snapshot::Writer writer;
+    if (!writer.open(path, sequence, _snapshot_flags)) {
+        return false;
+    }
 
-    Node<K, V>* tmp = _header;
-    while (tmp->forward[0] != _footer) {
-        tmp = tmp->forward[0];
-        if (tmp != NULL) {
-            out << *tmp;
+    Node<K, V>* tmp = _header->next(0);
+    for (; tmp != _footer; tmp = tmp->next(0)) {
+        ValueBlock<V>* block = tmp->value.load(std::memory_order_relaxed);
+        if (!block->expired() && !writer.add(tmp->key, block->value, block->expire_ms)) {
+            return false;
+        }
+    }
+    return writer.finish();
+}
+
+template<typename K, typename V>
+bool SkipList<K, V>::load(std::string path, uint64_t* sequence) {
+    snapshot::Reader reader;
+    switch (reader.open(path)) {
+    case snapshot::Reader::OK:
+        break;
+    case snapshot::Reader::NOT_FOUND:
+        return true;
+    case snapshot::Reader::BAD_MAGIC:
+        if (_snapshot_flags != 0) {
+            LOG(ERROR) << "text snapshot " << path << " has no snapshot flags, expected "
+                       << _snapshot_flags;
+            return false;
         }
+        return load_text(path);
+    default:
+        return false;
+    }
+    // values encoded another way would be misread
+    if (reader.flags() != _snapshot_flags) {
+        LOG(ERROR) << "snapshot " << path << " was written with snapshot flags "
+                   << reader.flags() << ", expected " << _snapshot_flags;
+        return false;
     }
 
-    out.close();
+    // records are sorted, so an empty list can be built bottom up: every
+    // node is appended after the last node of each of its levels
+    bool bulk = (_size == 0);
+    if (bulk && _bloom && reader.count() > _bloom_keys) {
+        rebuild_bloom_filter(reader.count());
+    }
+    if (bulk && _index && reader.count() > _index_keys) {
+        rebuild_hash_index(reader.count());
+    }
+    Node<K, V>* tail[MAX_LEVEL];
+    for (int i = 0; i < MAX_LEVEL; ++i) {
+        tail[i] = _header;
+    }
+    const char* key_data;
+    const char* value_data;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint64_t expire_ms;
+    K key;
+    V value;
+    bool ok = true;
+    while (reader.next(&key_data, &key_size, &value_data, &value_size, &expire_ms)) {
+        if (!snapshot::KeyDecoder<K>::decode(reader.version(), key_data, key_size, &key)
+                || !snapshot::Codec<V>::decode(value_data, value_size, &value)) {
+            ok = false;
+            break;
+        }
+        if (!bulk) {
+            insert(key, value, expire_ms);
+            continue;
+        }
+        if (tail[0] != _header && !(tail[0]->key < key)) {
+            LOG(ERROR) << "snapshot " << path << " is not sorted at key " << key;
+            ok = false;
+            break;
+        }
+        Node<K, V>* node;
+        create_node(get_random_level(), node, key, value, expire_ms);
+        if (expire_ms != 0) {
+            schedule_expire(key, expire_ms);
+        }
+        uint64_t hash = key_hash(key);
+        if (_bloom) {
+            _bloom->add(hash);
+        }
+        if (_index) {
+            index_add(hash, node);
+        }
+        uint64_t prefix = key_prefix(key);
+        for (int i = 0; i < node->level; ++i) {
+            if (i > 0) {
+                tail[i]->set_next_prefix(i, prefix);
+            }
+            tail[i]->set_next_relaxed(i, node);
+            tail[i] = node;
+        }
+        if (node->level > _level) {
+            _level.store(node->level, std::memory_order_relaxed);
+        }
+        bump(_size, 1);
+        add_bytes(payload_size(key), payload_size(value));
+        add_node_bytes(node->level, 1);
+    }
+    if (bulk) {
+        for (int i = 0; i < MAX_LEVEL; ++i) {
+            if (i > 0) {
+                tail[i]->set_next_prefix(i, UINT64_MAX);
+            }
+            tail[i]->set_next(i, _footer);
+        }
+    }
+    if (!ok || !reader.done()) {
+        LOG(ERROR) << "snapshot " << path << " is corrupted";
+        if (bulk) {
+            // drop the partial image, the list goes back to empty
+            free_list();
+            create_list();
+            if (_bloom) {
+                rebuild_bloom_filter(_bloom_keys);
+            }
+            if (_index) {
+                rebuild_hash_index(_index_keys);
+            }
+        }
+        return false;
+    }
+    if (sequence != nullptr) {
+        *sequence = reader.sequence();
+    }
+    if (_memory_limit != 0 && memory_bytes() > static_cast<int64_t>(_memory_limit)) {
+        evict();
+    }
+    return true;
 }
 
 template<typename K, typename V>
-bool SkipList<K, V>::load(std::string path) {
+bool SkipList<K, V>::load_text(std::string path) {
     std::ifstream in(path);
     std::string line;
     while (std::getline(in, line)) {
         K key;
         V value;
+        std::string text;
         //LOG(INFO) << line;
         std::stringstream linestream(line);
-        linestream >> key >> value;
+        linestream >> key >> text;
+        snapshot::Codec<V>::decode(text.data(), text.size(), &value);
         //LOG(INFO) << "key:" << key << " value:" << value;
         if (insert(key, value) == false) {
             in.close();
@@ -347,32 +1454,188 @@ bool SkipList<K, V>::load(std::string path) {
 }
 
 template<typename K, typename V>
-void SkipList<K, V>::defer_free(Node<K, V>* node) {
-    //LOG(INFO) << "push free list, key:" << node->key;
-    _lazy_trash_queue.push_back(node);
-    haz_gc();
+void SkipList<K, V>::enable_bloom_filter(size_t expected_keys) {
+    // counted by the writer, concurrent inserts would be filtered out
+    if (_concurrent) {
+        return;
+    }
+    rebuild_bloom_filter(std::max<size_t>(expected_keys, _size));
 }
 
 template<typename K, typename V>
-void SkipList<K, V>::haz_gc() {
-    if (_lazy_trash_queue.size() >= GC_THRESHOLD) {
-        auto it = _lazy_trash_queue.begin();
-        while (it != _lazy_trash_queue.end()){
-            if (!_all_haz_points.contains(*it)) {
-                //LOG(INFO) << "key:" << (*it)->key;
-                //LOG(INFO) << "free list size:" << _lazy_trash_queue.size();
-                delete *it;
-                *it = nullptr;
-                if (&*it != &_lazy_trash_queue.back()) {
-                    *it = _lazy_trash_queue.back();
+void SkipList<K, V>::rebuild_bloom_filter(size_t expected_keys) {
+    _bloom.reset(new BloomFilter(expected_keys));
+    _bloom_keys = expected_keys;
+    for (Node<K, V>* x = _header->next(0); x != _footer; x = x->next(0)) {
+        _bloom->add(bloom_hash(x->key));
+    }
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::enable_hash_index(size_t expected_keys) {
+    // maintained by the writer
+    if (_concurrent) {
+        return;
+    }
+    rebuild_hash_index(std::max<size_t>(expected_keys, _size));
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::rebuild_hash_index(size_t expected_keys) {
+    _index.reset(new Index(expected_keys));
+    _index_keys = expected_keys;
+    for (Node<K, V>* x = _header->next(0); x != _footer; x = x->next(0)) {
+        index_add(bloom_hash(x->key), x);
+    }
+}
+
+template<typename K, typename V>
+bool SkipList<K, V>::enable_concurrent_writes() {
+    if (_reclaimer.policy() != reclaim::EPOCH || _bloom || _index || _memory_limit != 0
+            || _size.load() != 0) {
+        return false;
+    }
+    // header and footer come from the pool, allocate them again from the
+    // heap like every node from now on
+    free_list();
+    _concurrent = true;
+    create_list();
+    _reclaimer.enable_shared_retire();
+    _reclaimer.start_thread();
+    return true;
+}
+
+template<typename K, typename V>
+bool SkipList<K, V>::begin_snapshot() {
+    // preserve has a single writer to follow
+    if (_concurrent || _snapshot_active.load(std::memory_order_acquire)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lk(_snapshot_mutex);
+    _snapshot_version = _version.load(std::memory_order_relaxed);
+    _snapshot_started = false;
+    _preserved.clear();
+    _snapshot_active.store(true, std::memory_order_release);
+    return true;
+}
+
+template<typename K, typename V>
+bool SkipList<K, V>::dump_snapshot(std::string path, uint64_t sequence) {
+    // The writer never frees nodes or values while the snapshot is active,
+    // so the walk may go through nodes unlinked meanwhile. It skips nodes
+    // whose value is newer than the frozen version and merges in the
+    // frozen entries the writer preserved, both in key order. Entries are picked in small chunks
+    // under the lock and written out of it, the writer waits at most a
+    // chunk when it has to preserve something.
+    static const size_t CHUNK = 64;
+    snapshot::Writer writer;
+    bool ok = writer.open(path, sequence, _snapshot_flags);
+    const uint64_t version = _snapshot_version;
+    Node<K, V>* cur = _header;
+    // a node and its value as of the frozen version
+    std::vector<std::pair<Node<K, V>*, ValueBlock<V>*>> nodes;
+    std::vector<std::pair<K, ValueBlock<V>>> frozen;
+    // true: next entry comes from nodes, false: from frozen
+    std::vector<bool> order;
+    bool end = false;
+    while (ok && !end) {
+        {
+            std::lock_guard<std::mutex> lk(_snapshot_mutex);
+            while (order.size() < CHUNK) {
+                Node<K, V>* next = cur->next(0);
+                ValueBlock<V>* block = nullptr;
+                while (next != _footer
+                        && (block = next->value.load(std::memory_order_acquire))->version > version) {
+                    next = next->next(0);
+                }
+                auto it = _preserved.begin();
+                if (next == _footer && it == _preserved.end()) {
+                    end = true;
+                    break;
+                }
+                if (it == _preserved.end() || (next != _footer && next->key < it->first)) {
+                    nodes.emplace_back(next, block);
+                    order.push_back(true);
+                    _snapshot_cursor = next->key;
+                    cur = next;
+                } else {
+                    // same key in both: the node was reached through an
+                    // unlinked node, the frozen entry holds the same value
+                    if (next != _footer && !(it->first < next->key)) {
+                        cur = next;
+                    }
+                    _snapshot_cursor = it->first;
+                    frozen.emplace_back(std::move(*it));
+                    _preserved.erase(it);
+                    order.push_back(false);
                 }
-                _lazy_trash_queue.pop_back();
-                //LOG(INFO) << "list end" << _lazy_trash_queue.end();
+                _snapshot_started = true;
+            }
+        }
+        auto node_it = nodes.begin();
+        auto frozen_it = frozen.begin();
+        for (bool from_node : order) {
+            // expired keys are left out like removed ones
+            if (from_node) {
+                const ValueBlock<V>* block = node_it->second;
+                ok = block->expired()
+                    || writer.add(node_it->first->key, block->value, block->expire_ms);
+                ++node_it;
             } else {
-                LOG(INFO) << "key:" << (*it)->key << " in use";
-                ++it;
+                const ValueBlock<V>& block = frozen_it->second;
+                ok = block.expired() || writer.add(frozen_it->first, block.value, block.expire_ms);
+                ++frozen_it;
+            }
+            if (!ok) {
+                break;
             }
         }
+        nodes.clear();
+        frozen.clear();
+        order.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lk(_snapshot_mutex);
+        _preserved.clear();
+        _snapshot_active.store(false, std::memory_order_release);
+    }
+    return ok && writer.finish();
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::preserve(Node<K, V>* node) {
+    ValueBlock<V>* block = node->value.load(std::memory_order_relaxed);
+    if (!_snapshot_active.load(std::memory_order_acquire)
+            || block->version > _snapshot_version) {
+        return;
+    }
+    std::lock_guard<std::mutex> lk(_snapshot_mutex);
+    // the snapshot may have ended meanwhile, or already written this key
+    if (!_snapshot_active.load(std::memory_order_relaxed)
+            || (_snapshot_started && !(_snapshot_cursor < node->key))) {
+        return;
+    }
+    _preserved.emplace(node->key, *block);
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::defer_free(void* p, int kind) {
+    if (_concurrent) {
+        _reclaimer.retire_shared(p, kind);
+        return;
+    }
+    _reclaimer.retire(p, kind);
+    gc();
+}
+
+template<typename K, typename V>
+void SkipList<K, V>::gc() {
+    // a running snapshot may walk any node unlinked since it began
+    if (_snapshot_active.load(std::memory_order_acquire)) {
+        return;
+    }
+    if (_reclaimer.retired() >= GC_THRESHOLD) {
+        _reclaimer.collect();
     }
 }
 }
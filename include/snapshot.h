@@ -0,0 +1,369 @@
+#ifndef KV_SERVER_SNAPSHOT_H
+#define KV_SERVER_SNAPSHOT_H
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <base/crc32c.h>
+#include <base/iobuf.h>
+#include <base/logging.h>
+
+namespace skiplist {
+// Binary snapshot of a skiplist, records are sorted by key:
+//
+// | Header | record ... | Footer |
+// record: | key size(4) | value size(4) | key | value | [expire(8)] |
+//
+// The top bit of value size tells the record carries the wall clock ms its
+// key expires at, see SkipList::insert.
+//
+// Footer::crc is crc32c of the header and every record, so a file cut or
+// damaged anywhere fails to load instead of silently losing keys.
+namespace snapshot {
+
+static const char MAGIC[8] = {'K', 'V', 'S', 'N', 'A', 'P', '\r', '\n'};
+// 2: keys are laid out by Codec<K> of the list's key type. Version 1 was
+// only written by lists with int keys, see KeyDecoder.
+// 3: expire times.
+static const uint32_t VERSION = 3;
+static const uint32_t HAS_EXPIRE = 1u << 31;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    // opaque to the skiplist, e.g. the last wal sequence the image holds
+    uint64_t sequence;
+    // opaque to the skiplist as well, how the values are encoded. A
+    // snapshot only loads into a list with the same flags, older versions
+    // wrote 0 here.
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct Footer {
+    uint64_t count;
+    uint32_t crc;
+    uint32_t reserved;
+};
+
+// how a key or value is laid out in a record
+template <typename T, typename Enable = void>
+struct Codec;
+
+// integers are stored as 8 bytes so the key type can be widened later
+template <typename T>
+struct Codec<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+    static void encode(const T& v, std::string* out) {
+        int64_t wide = static_cast<int64_t>(v);
+        out->append(reinterpret_cast<const char*>(&wide), sizeof(wide));
+    }
+    static bool decode(const char* data, size_t size, T* v) {
+        int64_t wide;
+        if (size != sizeof(wide)) {
+            return false;
+        }
+        memcpy(&wide, data, sizeof(wide));
+        *v = static_cast<T>(wide);
+        return static_cast<int64_t>(*v) == wide;
+    }
+};
+
+template <>
+struct Codec<std::string> {
+    static void encode(const std::string& v, std::string* out) {
+        out->append(v);
+    }
+    static bool decode(const char* data, size_t size, std::string* v) {
+        v->assign(data, size);
+        return true;
+    }
+};
+
+template <>
+struct Codec<base::IOBuf> {
+    static void encode(const base::IOBuf& v, std::string* out) {
+        size_t offset = out->size();
+        out->resize(offset + v.size());
+        v.copy_to(&(*out)[offset], v.size());
+    }
+    static bool decode(const char* data, size_t size, base::IOBuf* v) {
+        v->clear();
+        v->append(data, size);
+        return true;
+    }
+};
+
+// Decodes a key of a snapshot of any version. Codec<K> unless a key
+// type specializes it to read what older versions wrote.
+template <typename K>
+struct KeyDecoder {
+    static bool decode(uint32_t version, const char* data, size_t size, K* key) {
+        (void)version;
+        return Codec<K>::decode(data, size, key);
+    }
+};
+
+// fsync the directory holding file, so that creating or renaming file
+// survives a crash
+inline int sync_dir(const std::string& file) {
+    size_t slash = file.rfind('/');
+    std::string dir = slash == std::string::npos ? "."
+            : (slash == 0 ? "/" : file.substr(0, slash));
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open dir " << dir;
+        return -1;
+    }
+    int ret = fsync(fd);
+    if (ret != 0) {
+        PLOG(ERROR) << "Fail to sync dir " << dir;
+    }
+    ::close(fd);
+    return ret == 0 ? 0 : -1;
+}
+
+// Writes into <path>.tmp and renames it over path once everything is
+// synced, a crash in the middle leaves the previous snapshot intact.
+class Writer {
+public:
+    Writer() { }
+    ~Writer() {
+        if (_fd >= 0) {
+            ::close(_fd);
+            unlink(_tmp_path.c_str());
+        }
+    }
+
+    bool open(const std::string& path, uint64_t sequence, uint32_t flags = 0) {
+        _path = path;
+        _tmp_path = path + ".tmp";
+        _fd = ::open(_tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (_fd < 0) {
+            PLOG(ERROR) << "Fail to open " << _tmp_path;
+            return false;
+        }
+        Header header;
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.version = VERSION;
+        header.header_size = sizeof(Header);
+        header.sequence = sequence;
+        header.flags = flags;
+        header.reserved = 0;
+        return append(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+
+    // expire_ms 0 means the key never expires
+    template <typename K, typename V>
+    bool add(const K& key, const V& value, uint64_t expire_ms = 0) {
+        _scratch.clear();
+        Codec<K>::encode(key, &_scratch);
+        uint32_t key_size = _scratch.size();
+        Codec<V>::encode(value, &_scratch);
+        uint32_t sizes[2] = {key_size, static_cast<uint32_t>(_scratch.size() - key_size)};
+        if (expire_ms != 0) {
+            sizes[1] |= HAS_EXPIRE;
+            _scratch.append(reinterpret_cast<const char*>(&expire_ms), sizeof(expire_ms));
+        }
+        ++_count;
+        return append(reinterpret_cast<const char*>(sizes), sizeof(sizes))
+            && append(_scratch.data(), _scratch.size());
+    }
+
+    bool finish() {
+        Footer footer;
+        footer.count = _count;
+        footer.crc = _crc;
+        footer.reserved = 0;
+        _buf.append(reinterpret_cast<const char*>(&footer), sizeof(footer));
+        if (!flush() || fsync(_fd) != 0) {
+            PLOG(ERROR) << "Fail to write " << _tmp_path;
+            return false;
+        }
+        ::close(_fd);
+        _fd = -1;
+        if (rename(_tmp_path.c_str(), _path.c_str()) != 0) {
+            PLOG(ERROR) << "Fail to rename " << _tmp_path << " to " << _path;
+            unlink(_tmp_path.c_str());
+            return false;
+        }
+        // the rename is not durable until the directory is synced, the
+        // caller must not drop the wal before that
+        return sync_dir(_path) == 0;
+    }
+
+    uint64_t count() const {
+        return _count;
+    }
+private:
+    bool append(const char* data, size_t size) {
+        _crc = base::crc32c::Extend(_crc, data, size);
+        _buf.append(data, size);
+        return _buf.size() < BUF_SIZE || flush();
+    }
+
+    bool flush() {
+        const char* p = _buf.data();
+        size_t left = _buf.size();
+        while (left > 0) {
+            ssize_t n = ::write(_fd, p, left);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                PLOG(ERROR) << "Fail to write " << _tmp_path;
+                return false;
+            }
+            p += n;
+            left -= n;
+        }
+        _buf.clear();
+        return true;
+    }
+
+    static const size_t BUF_SIZE = 1 << 20;
+    std::string _path;
+    std::string _tmp_path;
+    int _fd = -1;
+    uint32_t _crc = 0;
+    uint64_t _count = 0;
+    std::string _buf;
+    std::string _scratch;
+};
+
+// Maps a snapshot read only and walks its records in place.
+class Reader {
+public:
+    enum Status {
+        OK,
+        NOT_FOUND,
+        // not a binary snapshot, e.g. written by an older version
+        BAD_MAGIC,
+        CORRUPTED,
+    };
+
+    Reader() { }
+    ~Reader() {
+        if (_data != nullptr) {
+            munmap(const_cast<char*>(_data), _size);
+        }
+    }
+
+    Status open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            if (errno == ENOENT) {
+                return NOT_FOUND;
+            }
+            PLOG(ERROR) << "Fail to open " << path;
+            return CORRUPTED;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            PLOG(ERROR) << "Fail to stat " << path;
+            ::close(fd);
+            return CORRUPTED;
+        }
+        _size = st.st_size;
+        if (_size < sizeof(MAGIC)) {
+            ::close(fd);
+            return _size == 0 ? NOT_FOUND : BAD_MAGIC;
+        }
+        void* addr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            PLOG(ERROR) << "Fail to mmap " << path;
+            return CORRUPTED;
+        }
+        _data = static_cast<const char*>(addr);
+        madvise(addr, _size, MADV_SEQUENTIAL);
+
+        if (memcmp(_data, MAGIC, sizeof(MAGIC)) != 0) {
+            return BAD_MAGIC;
+        }
+        if (_size < sizeof(Header) + sizeof(Footer)) {
+            return CORRUPTED;
+        }
+        memcpy(&_header, _data, sizeof(Header));
+        if (_header.version < 1 || _header.version > VERSION
+                || _header.header_size < sizeof(Header)
+                || _header.header_size > _size - sizeof(Footer)) {
+            LOG(ERROR) << "Unsupported snapshot version " << _header.version;
+            return CORRUPTED;
+        }
+        memcpy(&_footer, _data + _size - sizeof(Footer), sizeof(Footer));
+        _pos = _header.header_size;
+        _end = _size - sizeof(Footer);
+        _crc = base::crc32c::Value(_data, _pos);
+        return OK;
+    }
+
+    // Point key/value at the next record, false at the end or on a
+    // malformed record, tell them apart with done(). expire_ms is 0 for a
+    // key that never expires.
+    bool next(const char** key, uint32_t* key_size, const char** value, uint32_t* value_size,
+            uint64_t* expire_ms) {
+        if (_end - _pos < 2 * sizeof(uint32_t)) {
+            return false;
+        }
+        uint32_t sizes[2];
+        memcpy(sizes, _data + _pos, sizeof(sizes));
+        bool has_expire = _header.version >= 3 && (sizes[1] & HAS_EXPIRE);
+        if (has_expire) {
+            sizes[1] &= ~HAS_EXPIRE;
+        }
+        size_t record_size = sizeof(sizes) + static_cast<size_t>(sizes[0]) + sizes[1]
+            + (has_expire ? sizeof(uint64_t) : 0);
+        if (_end - _pos < record_size) {
+            return false;
+        }
+        *key = _data + _pos + sizeof(sizes);
+        *key_size = sizes[0];
+        *value = *key + sizes[0];
+        *value_size = sizes[1];
+        *expire_ms = 0;
+        if (has_expire) {
+            memcpy(expire_ms, *value + sizes[1], sizeof(*expire_ms));
+        }
+        _crc = base::crc32c::Extend(_crc, _data + _pos, record_size);
+        _pos += record_size;
+        ++_count;
+        return true;
+    }
+
+    // every record was read and matches the footer
+    bool done() const {
+        return _pos == _end && _count == _footer.count && _crc == _footer.crc;
+    }
+
+    uint64_t sequence() const {
+        return _header.sequence;
+    }
+    uint32_t version() const {
+        return _header.version;
+    }
+    uint32_t flags() const {
+        return _header.flags;
+    }
+    uint64_t count() const {
+        return _footer.count;
+    }
+private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+    size_t _pos = 0;
+    size_t _end = 0;
+    uint32_t _crc = 0;
+    uint64_t _count = 0;
+    Header _header;
+    Footer _footer;
+};
+}
+}
+#endif
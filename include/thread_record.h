@@ -0,0 +1,150 @@
+#ifndef KV_SERVER_THREAD_RECORD_H
+#define KV_SERVER_THREAD_RECORD_H
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace tls {
+
+// Base of a per thread record, padded to its own cache line by the
+// derived type so readers on different cores never share a line.
+struct RecordBase {
+    RecordBase* next = nullptr;
+    // held by a live thread, a record is reused once its thread exits
+    std::atomic<bool> owned{true};
+};
+
+namespace detail {
+inline std::mutex& registry_mutex() {
+    static std::mutex mutex;
+    return mutex;
+}
+
+// ids of registries still alive, a thread exiting after its registry
+// went away must not touch the record
+inline std::unordered_set<uint64_t>& live_registries() {
+    static std::unordered_set<uint64_t> ids;
+    return ids;
+}
+
+inline uint64_t next_registry_id() {
+    static std::atomic<uint64_t> id(0);
+    return ++id;
+}
+
+// records of the calling thread, one per registry it used
+struct ThreadCache {
+    ~ThreadCache() {
+        std::lock_guard<std::mutex> lk(registry_mutex());
+        for (auto& entry : records) {
+            if (live_registries().count(entry.first) != 0) {
+                entry.second->owned.store(false, std::memory_order_release);
+            }
+        }
+    }
+
+    RecordBase* find(uint64_t id) {
+        if (last.first == id) {
+            return last.second;
+        }
+        for (auto& entry : records) {
+            if (entry.first == id) {
+                last = entry;
+                return entry.second;
+            }
+        }
+        return nullptr;
+    }
+
+    std::pair<uint64_t, RecordBase*> last{0, nullptr};
+    std::vector<std::pair<uint64_t, RecordBase*>> records;
+};
+
+inline ThreadCache& thread_cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+}
+}
+
+// Hands every thread its own record of type R, created on the thread's
+// first call and kept until it exits, so the read path does no shared
+// writes to find one. Records are walked by the owner of the registry and
+// freed with it. With bthreads a record belongs to the worker pthread,
+// callers must not block while they use it.
+template <typename R>
+class Registry {
+public:
+    Registry() : _id(detail::next_registry_id()), _head(nullptr) {
+        std::lock_guard<std::mutex> lk(detail::registry_mutex());
+        detail::live_registries().insert(_id);
+    }
+    ~Registry() {
+        {
+            std::lock_guard<std::mutex> lk(detail::registry_mutex());
+            detail::live_registries().erase(_id);
+        }
+        R* p = _head.load(std::memory_order_relaxed);
+        while (p != nullptr) {
+            R* next = static_cast<R*>(p->next);
+            p->~R();
+            free(p);
+            p = next;
+        }
+    }
+
+    Registry(const Registry&) = delete;
+    Registry& operator=(const Registry&) = delete;
+
+    R* local() {
+        detail::ThreadCache& cache = detail::thread_cache();
+        RecordBase* r = cache.find(_id);
+        if (r == nullptr) {
+            r = acquire();
+            cache.records.emplace_back(_id, r);
+            cache.last = cache.records.back();
+        }
+        return static_cast<R*>(r);
+    }
+
+    template <typename F>
+    void for_each(F f) const {
+        for (R* p = _head.load(std::memory_order_acquire); p;
+                p = static_cast<R*>(p->next)) {
+            f(p);
+        }
+    }
+private:
+    R* acquire() {
+        for (R* p = _head.load(std::memory_order_acquire); p;
+                p = static_cast<R*>(p->next)) {
+            bool owned = false;
+            if (!p->owned.load(std::memory_order_relaxed)
+                    && p->owned.compare_exchange_strong(owned, true)) {
+                return p;
+            }
+        }
+        // plain new only guarantees the alignment of max_align_t before
+        // C++17, the record would lose its own cache line
+        void* mem = nullptr;
+        size_t align = alignof(R) < sizeof(void*) ? sizeof(void*) : alignof(R);
+        if (posix_memalign(&mem, align, sizeof(R)) != 0) {
+            throw std::bad_alloc();
+        }
+        R* p = new (mem) R();
+        R* head = _head.load();
+        do {
+            p->next = head;
+        } while (!_head.compare_exchange_weak(head, p));
+        return p;
+    }
+
+    const uint64_t _id;
+    std::atomic<R*> _head;
+};
+}
+#endif
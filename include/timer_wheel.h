@@ -0,0 +1,121 @@
+#ifndef KV_SERVER_TIMER_WHEEL_H
+#define KV_SERVER_TIMER_WHEEL_H
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace skiplist {
+
+// milliseconds since the unix epoch, expire times outlive restarts
+inline uint64_t wall_time_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Hierarchical timer wheel: LEVELS wheels of SLOTS slots, a slot of level
+// l spans SLOTS^l ticks. An item is put in the lowest level whose turn
+// reaches its tick and moves down a level when the slot it waits in comes
+// round, so add is O(1) and an item is moved at most LEVELS times. Items
+// beyond the last level wait in its farthest slot and are placed again.
+// Items cannot be cancelled, the owner drops the stale ones when they are
+// due. Not thread safe.
+template <typename T>
+class TimerWheel {
+public:
+    struct Entry {
+        uint64_t expire_ms;
+        T item;
+    };
+
+    TimerWheel(uint64_t tick_ms, uint64_t now_ms)
+        : _tick_ms(tick_ms > 0 ? tick_ms : 1)
+        , _current(now_ms / _tick_ms)
+        , _slots(LEVELS * SLOTS) { }
+
+    void add(uint64_t expire_ms, T item) {
+        place(Entry{expire_ms, std::move(item)});
+        ++_size;
+    }
+
+    // turn the wheel to now_ms, the items due by then are appended to due
+    void advance(uint64_t now_ms, std::vector<Entry>* due) {
+        uint64_t target = now_ms / _tick_ms;
+        while (_current < target && _size > _ready.size()) {
+            ++_current;
+            // the levels turning over, the highest first, so that what
+            // comes down lands in a slot not handled yet
+            int top = 0;
+            while (top + 1 < LEVELS && (_current & low_mask(top + 1)) == 0) {
+                ++top;
+            }
+            for (int l = top; l > 0; --l) {
+                std::vector<Entry> entries;
+                entries.swap(slot(l, _current));
+                for (auto& e : entries) {
+                    place(std::move(e));
+                }
+            }
+            take(&slot(0, _current), due);
+        }
+        if (_current < target) {
+            _current = target;
+        }
+        take(&_ready, due);
+    }
+
+    // items added and not returned by advance yet
+    size_t size() const {
+        return _size;
+    }
+private:
+    static const int BITS = 6;
+    static const int SLOTS = 1 << BITS;
+    // 64^4 ticks ahead before an item has to be placed again
+    static const int LEVELS = 4;
+
+    static uint64_t low_mask(int level) {
+        return (1ULL << (BITS * level)) - 1;
+    }
+
+    std::vector<Entry>& slot(int level, uint64_t tick) {
+        return _slots[level * SLOTS + ((tick >> (BITS * level)) & (SLOTS - 1))];
+    }
+
+    void place(Entry e) {
+        uint64_t tick = (e.expire_ms + _tick_ms - 1) / _tick_ms;
+        if (tick <= _current) {
+            _ready.push_back(std::move(e));
+            return;
+        }
+        // the lowest level where tick is less than a turn ahead, its slot
+        // comes round before the current one again
+        for (int l = 0; l < LEVELS; ++l) {
+            if ((tick >> (BITS * l)) - (_current >> (BITS * l)) < SLOTS) {
+                slot(l, tick).push_back(std::move(e));
+                return;
+            }
+        }
+        const int last = LEVELS - 1;
+        slot(last, _current + (static_cast<uint64_t>(SLOTS - 1) << (BITS * last)))
+            .push_back(std::move(e));
+    }
+
+    void take(std::vector<Entry>* from, std::vector<Entry>* due) {
+        for (auto& e : *from) {
+            due->push_back(std::move(e));
+        }
+        _size -= from->size();
+        from->clear();
+    }
+
+    uint64_t _tick_ms;
+    uint64_t _current;
+    std::vector<std::vector<Entry>> _slots;
+    // added with a tick already passed, returned by the next advance
+    std::vector<Entry> _ready;
+    size_t _size = 0;
+};
+}
+#endif
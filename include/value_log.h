@@ -0,0 +1,165 @@
+#ifndef KV_SERVER_VALUE_LOG_H
+#define KV_SERVER_VALUE_LOG_H
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <base/iobuf.h>
+#include "byte_key.h"
+
+namespace kvservice {
+
+// where the bytes of a value sit in the value log
+struct ValueHandle {
+    uint32_t segment = 0;
+    uint64_t offset = 0;
+    uint32_t size = 0;
+
+    bool operator==(const ValueHandle& other) const {
+        return segment == other.segment && offset == other.offset && size == other.size;
+    }
+};
+
+// A value compaction copied into a new segment. The writer switches the
+// key over only if it still refers to from.
+struct ValueMove {
+    skiplist::ByteKey key;
+    ValueHandle from;
+    ValueHandle to;
+};
+
+// Append-only log of large values, see --value_log_path. The skiplist
+// keeps keys and small values, a value of at least threshold bytes is
+// appended to the log and the skiplist holds a handle to it. A stored
+// value starts with a tag:
+//
+// | INLINE(1) | value |   or   | HANDLE(1) | segment(4) | offset(8) | size(4) |
+//
+// The log is split into segment files named <path>.<segment id>, record
+// layout:
+//
+// | crc32c(4) | length(4) | expire(8) | key size(4) | key | value |
+//
+// length counts the bytes after itself, crc32c covers the same bytes.
+// The writer thread appends to the newest segment and seals it once it
+// reaches segment_bytes. Compaction copies the live values of a sealed
+// segment into a new one, the writer switches the keys over and the old
+// segment is deleted once no dump refers to it any more. Readers pread the
+// value, a handle is only published once its record is written.
+class ValueLog {
+public:
+    // keep_until_dump: segments compacted away stay on disk until a dump
+    // begun after that is written, the previous one may refer to them
+    ValueLog(const std::string& path, size_t threshold, int64_t segment_bytes,
+            bool keep_until_dump)
+        : _path(path), _threshold(threshold), _segment_bytes(segment_bytes)
+        , _keep_until_dump(keep_until_dump) { }
+
+    ValueLog(const ValueLog&) = delete;
+    ValueLog& operator=(const ValueLog&) = delete;
+
+    // open the existing segments and start a new one to append to
+    int open();
+
+    // snapshot flags of a skiplist holding stored values, a dump of plain
+    // values does not load with the value log nor the other way round
+    static const uint32_t SNAPSHOT_FLAG = 1;
+
+    static void encode(const ValueHandle& handle, base::IOBuf* stored);
+    // false if stored holds the value itself
+    static bool decode(const base::IOBuf& stored, ValueHandle* handle);
+
+    // Writer only. stored gets the value, or a handle once a large value is
+    // appended to the log. false if the log could not be written.
+    bool store(const skiplist::ByteKey& key, const base::IOBuf& value, uint64_t expire_ms,
+            base::IOBuf* stored);
+    // Any thread, the value of a stored one. Returns 0, 1 if the segment
+    // holding it was compacted away meanwhile and the key has to be looked
+    // up again, -1 on a read error.
+    int load(const base::IOBuf& stored, base::IOBuf* value);
+
+    // writer only: a stored value is referred to by the skiplist, or not
+    // any more once it is replaced or removed
+    void add_live(const base::IOBuf& stored);
+    void drop(const base::IOBuf& stored);
+    // writer only, forget what is live before counting again
+    void reset_live();
+
+    // fsync the segment being appended to, sealed ones are synced already.
+    // Any thread.
+    int sync();
+    // The writer fixes the content of a dump, returns its number for
+    // end_dump. Segments compacted away before it began are deleted once
+    // it is written.
+    uint64_t begin_dump();
+    void end_dump(uint64_t dump, bool ok);
+
+    // Compaction thread. Compact the sealed segment with the largest dead
+    // share if at least ratio of it is dead: copy the values is_live
+    // reports as still referred to into a new segment and hand the moves to
+    // relocate, which returns false if the writer did not apply them.
+    // Returns 1 if a segment was compacted, 0 if none is due or the one due
+    // still holds values of expired keys, -1 on error.
+    int compact(double ratio,
+            const std::function<bool(const skiplist::ByteKey&, const ValueHandle&)>& is_live,
+            const std::function<bool(std::vector<ValueMove>*)>& relocate);
+
+    // bytes of every segment, and of the values still referred to
+    int64_t bytes() const;
+    int64_t live_bytes() const;
+private:
+    struct Segment {
+        Segment(uint32_t i, const std::string& f, int d) : id(i), file(f), fd(d) { }
+        ~Segment();
+
+        const uint32_t id;
+        const std::string file;
+        const int fd;
+        // written by one thread at a time: the writer for the newest
+        // segment, compaction for the one it fills
+        std::atomic<int64_t> bytes{0};
+        // value bytes the skiplist refers to, changed by the writer
+        std::atomic<int64_t> live{0};
+    };
+
+    std::shared_ptr<Segment> find(uint32_t id) const;
+    // a new empty segment, not listed yet
+    std::shared_ptr<Segment> create(uint32_t id);
+    // seal the newest segment and start the next one
+    int roll();
+    // unlist segment, delete its file now or after the next dump
+    void retire(const std::shared_ptr<Segment>& segment);
+    // encode a record into buf, returns the offset of the value in it
+    static size_t encode_record(const skiplist::ByteKey& key, const base::IOBuf& value,
+            uint64_t expire_ms, std::string* buf);
+
+    static const char INLINE = 0;
+    static const char HANDLE = 1;
+    static const size_t HANDLE_SIZE = 17;
+
+    const std::string _path;
+    const size_t _threshold;
+    const int64_t _segment_bytes;
+    const bool _keep_until_dump;
+    // guards _segments, _active, _retired and _stalled, readers only hold
+    // it to look a segment up
+    mutable std::mutex _mutex;
+    std::map<uint32_t, std::shared_ptr<Segment>> _segments;
+    // the segment appended to, only the writer changes it
+    std::shared_ptr<Segment> _active;
+    std::atomic<uint32_t> _next_id{0};
+    // segments compacted away, with the dumps begun by then
+    std::vector<std::pair<std::shared_ptr<Segment>, uint64_t>> _retired;
+    // segments compaction left over with live bytes, by their live bytes
+    // then, skipped until those change
+    std::map<uint32_t, int64_t> _stalled;
+    std::atomic<uint64_t> _dumps{0};
+    // record being appended by the writer
+    std::string _buf;
+};
+}
+#endif
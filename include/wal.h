@@ -0,0 +1,94 @@
+#ifndef KV_SERVER_WAL_H
+#define KV_SERVER_WAL_H
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <base/iobuf.h>
+#include "byte_key.h"
+
+namespace kvservice {
+
+// files named <path>.<number>, sorted by number
+int list_numbered_files(const std::string& path,
+        std::vector<std::pair<uint64_t, std::string>>* files);
+// write all of data, retrying short writes
+int write_full(int fd, const char* data, size_t len);
+
+struct WalRecord {
+    enum Type {
+        PUT = 1,
+        REMOVE = 2,
+    };
+
+    uint64_t sequence;
+    uint8_t type;
+    skiplist::ByteKey key;
+    base::IOBuf value;
+    // PUT only, wall clock ms the key expires at, 0 for never
+    uint64_t expire_ms = 0;
+};
+
+// Append-only write ahead log, split into segment files named
+// <path>.<first sequence of the segment>. Record layout:
+//
+// | crc32c(4) | length(4) | sequence(8) | type(1) | key size(4) | key | [expire(8)] | value |
+//
+// length counts the bytes after itself, crc32c covers the same bytes.
+// expire is there when a flag is set in the type.
+// Records of older versions have no key size and an int64 key(8) instead,
+// they are told apart by the type and replayed as ByteKey::from_int64.
+// Not thread safe, only the writer thread of a shard touches it, except
+// for purge.
+class Wal {
+public:
+    enum SyncPolicy {
+        // fsync every batch before it is acknowledged
+        SYNC_ALWAYS,
+        // fsync at most every sync interval, batches wait for it
+        SYNC_INTERVAL,
+        // never fsync, acknowledge once the write() is done
+        SYNC_NONE,
+    };
+
+    static int parse_sync_policy(const std::string& name, SyncPolicy* policy);
+
+    explicit Wal(const std::string& path) : _path(path) { }
+    ~Wal() {close();}
+
+    // Replay every record with sequence > from_seq in order, drop a torn
+    // record at the tail of the last segment. last_seq is set to the
+    // largest sequence found, or left as is when the log is empty.
+    int replay(uint64_t from_seq,
+            const std::function<void(const WalRecord&)>& apply,
+            uint64_t* last_seq);
+    // start a new segment, first record appended will be next_seq
+    int open(uint64_t next_seq);
+    void close();
+
+    // encode a record into the pending buffer
+    void append(uint64_t sequence, uint8_t type, const skiplist::ByteKey& key,
+            const base::IOBuf* value, uint64_t expire_ms = 0);
+    // write the pending buffer to the current segment
+    int flush();
+    int sync();
+    // Remove segments holding only records <= upto_seq, the newest segment
+    // is always kept. Touches no writer state, may run on any thread.
+    int purge(uint64_t upto_seq);
+
+    int64_t bytes() const {
+        return _bytes;
+    }
+private:
+    int replay_segment(const std::string& file, bool last, uint64_t from_seq,
+            const std::function<void(const WalRecord&)>& apply,
+            uint64_t* last_seq);
+
+    std::string _path;
+    int _fd = -1;
+    // bytes of the current segment known to be written
+    int64_t _bytes = 0;
+    std::string _buf;
+};
+}
+#endif
@@ -0,0 +1,132 @@
+#ifndef KV_SERVER_WRITE_RING_H
+#define KV_SERVER_WRITE_RING_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace kvservice {
+
+// busy wait hint, lets the sibling hyperthread run
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Bounded multi producer single consumer ring. Every slot carries a
+// sequence telling whose turn it is: a producer claims a position with
+// one CAS on the tail and publishes the item by bumping the slot's
+// sequence, the consumer takes slots in order and hands them back one
+// lap later. push never allocates and fails once the ring is full.
+template <typename T>
+class WriteRing {
+public:
+    // capacity is rounded up to a power of 2
+    explicit WriteRing(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity) {
+            n <<= 1;
+        }
+        _mask = n - 1;
+        _slots = static_cast<Slot*>(allocate(alignof(Slot), n * sizeof(Slot)));
+        for (size_t i = 0; i < n; ++i) {
+            new (&_slots[i]) Slot();
+            _slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    ~WriteRing() {
+        for (size_t i = 0; i <= _mask; ++i) {
+            _slots[i].~Slot();
+        }
+        free(_slots);
+    }
+
+    WriteRing(const WriteRing&) = delete;
+    WriteRing& operator=(const WriteRing&) = delete;
+
+    // plain new only guarantees the alignment of max_align_t before C++17,
+    // head and tail would lose their own cache lines
+    static void* operator new(size_t size) {
+        return allocate(alignof(WriteRing), size);
+    }
+    static void operator delete(void* p) {
+        free(p);
+    }
+
+    // any thread, false if the ring is full
+    bool push(T item) {
+        uint64_t pos = _tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = _slots[pos & _mask];
+            uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(sequence - pos);
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.item = item;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // the consumer has not taken this slot one lap ago
+                return false;
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // consumer only, false if the next item is not published yet
+    bool pop(T* item) {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        Slot& slot = _slots[head & _mask];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+            return false;
+        }
+        *item = slot.item;
+        slot.sequence.store(head + _mask + 1, std::memory_order_release);
+        _head.store(head + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // consumer only
+    bool empty() const {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        return _slots[head & _mask].sequence.load(std::memory_order_acquire) != head + 1;
+    }
+
+    // claimed and not taken yet, approximate from other threads
+    size_t size() const {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        uint64_t tail = _tail.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t capacity() const {
+        return _mask + 1;
+    }
+private:
+    static void* allocate(size_t align, size_t size) {
+        void* mem = nullptr;
+        if (posix_memalign(&mem, align, size) != 0) {
+            throw std::bad_alloc();
+        }
+        return mem;
+    }
+
+    // a slot per cache line, neighbouring producers do not share one
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> sequence;
+        T item;
+    };
+
+    // posix_memalign'ed
+    Slot* _slots;
+    size_t _mask;
+    // next position producers claim, and the next one the consumer takes
+    alignas(64) std::atomic<uint64_t> _tail{0};
+    alignas(64) std::atomic<uint64_t> _head{0};
+};
+}
+#endif
@@ -0,0 +1,330 @@
+#include <gflags/gflags.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <base/logging.h>
+#include <base/time.h>
+#include "histogram.h"
+#include "key_generator.h"
+#include "server.h"
+
+DEFINE_string(bench_target, "skiplist", "what is measured: skiplist(SkipList called directly) "
+        "or service(KVServiceImpl called in process, no network)");
+DEFINE_string(key_distribution, "uniform", "key distribution: uniform, zipfian or sequential");
+DEFINE_double(zipf_theta, 0.99, "skew of the zipfian distribution, in (0, 1)");
+DEFINE_int32(key_count, 1000000, "keys in the dataset, all of them are loaded before measuring");
+DEFINE_int32(value_size, 100, "bytes per value");
+DEFINE_double(read_ratio, 0.9, "fraction of gets, the other operations are puts");
+DEFINE_int32(threads, 4, "threads issuing operations");
+DEFINE_int32(warmup_s, 1, "seconds run before measuring");
+DEFINE_int32(duration_s, 10, "seconds measured");
+DEFINE_string(output, "", "file the json report is written to, stdout if empty");
+DECLARE_string(dump_file);
+DECLARE_string(wal_path);
+DECLARE_int32(snapshot_interval_s);
+DECLARE_int64(bloom_filter_keys);
+DECLARE_int64(hash_index_keys);
+DECLARE_string(reclaim_policy);
+DECLARE_bool(background_gc);
+DECLARE_string(write_mode);
+
+namespace kvservice {
+namespace {
+
+// what the workers drive, get and put may be called from any thread
+class Target {
+public:
+    virtual ~Target() { }
+    virtual int start() = 0;
+    virtual bool get(int key) = 0;
+    virtual bool put(int key, const std::string& value) = 0;
+};
+
+// the skiplist alone, configured like a shard
+class SkipListTarget : public Target {
+public:
+    int start() override {
+        reclaim::Policy policy;
+        if (reclaim::parse_policy(FLAGS_reclaim_policy, &policy) != 0) {
+            LOG(ERROR) << "unknown reclaim_policy:" << FLAGS_reclaim_policy;
+            return -1;
+        }
+        _list.reset(new KVSkipList(policy));
+        if (FLAGS_write_mode == "direct") {
+            if (!_list->enable_concurrent_writes()) {
+                LOG(ERROR) << "write_mode direct needs the epoch reclaim_policy";
+                return -1;
+            }
+        } else if (FLAGS_background_gc) {
+            _list->start_background_gc();
+        }
+        if (FLAGS_bloom_filter_keys > 0) {
+            _list->enable_bloom_filter(FLAGS_bloom_filter_keys);
+        }
+        if (FLAGS_hash_index_keys > 0) {
+            _list->enable_hash_index(FLAGS_hash_index_keys);
+        }
+        return 0;
+    }
+
+    bool get(int key) override {
+        base::IOBuf value;
+        return _list->search(skiplist::ByteKey::from_int64(key), value);
+    }
+
+    // one writer at a time, the part of the shard writer thread, unless
+    // the list takes concurrent writes
+    bool put(int key, const std::string& value) override {
+        skiplist::ByteKey list_key = skiplist::ByteKey::from_int64(key);
+        base::IOBuf buf;
+        buf.append(value);
+        if (_list->concurrent_writes()) {
+            return _list->insert(list_key, buf);
+        }
+        std::lock_guard<std::mutex> lk(_writer_mutex);
+        return _list->insert(list_key, buf);
+    }
+private:
+    std::unique_ptr<KVSkipList> _list;
+    std::mutex _writer_mutex;
+};
+
+// waits for a service call, done may run on a writer thread
+class SyncClosure : public ::google::protobuf::Closure {
+public:
+    void Run() override {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _done = true;
+        _cond.notify_one();
+    }
+    void wait() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [this]{return _done;});
+    }
+private:
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _done = false;
+};
+
+// the whole service path without the network: routing, write queues,
+// group commit and the wal if enabled
+class ServiceTarget : public Target {
+public:
+    int start() override {
+        return _service.start();
+    }
+
+    bool get(int key) override {
+        baidu::rpc::Controller cntl;
+        GetRequest request;
+        CommonResponse response;
+        SyncClosure done;
+        request.set_key(key);
+        request.set_value_in_attachment(true);
+        _service.get(&cntl, &request, &response, &done);
+        done.wait();
+        return response.code() == 200;
+    }
+
+    bool put(int key, const std::string& value) override {
+        baidu::rpc::Controller cntl;
+        PutRequest request;
+        CommonResponse response;
+        SyncClosure done;
+        request.set_key(key);
+        cntl.request_attachment().append(value);
+        _service.put(&cntl, &request, &response, &done);
+        done.wait();
+        return response.code() == 200;
+    }
+private:
+    KVServiceImpl _service;
+};
+
+enum Phase {
+    WARMUP,
+    MEASURE,
+    STOP,
+};
+
+struct OpStats {
+    Histogram latency_ns;
+    // gets that found nothing, puts that failed
+    uint64_t misses = 0;
+};
+
+struct WorkerStats {
+    OpStats get;
+    OpStats put;
+};
+
+void run_worker(Target* target, KeyGenerator keys, int index,
+        const std::atomic<int>* phase, WorkerStats* stats) {
+    std::mt19937_64 rng(index + 1);
+    std::bernoulli_distribution is_read(FLAGS_read_ratio);
+    std::string value(FLAGS_value_size, 'v');
+    int current;
+    while ((current = phase->load(std::memory_order_relaxed)) != STOP) {
+        int key = static_cast<int>(keys.next());
+        bool read = is_read(rng);
+        int64_t start = base::monotonic_time_ns();
+        bool ok = read ? target->get(key) : target->put(key, value);
+        int64_t latency = base::monotonic_time_ns() - start;
+        if (current != MEASURE) {
+            continue;
+        }
+        OpStats& op = read ? stats->get : stats->put;
+        op.latency_ns.record(latency);
+        if (!ok) {
+            ++op.misses;
+        }
+    }
+}
+
+void write_op(std::ostream& os, const char* name, const OpStats& op, double seconds) {
+    const Histogram& h = op.latency_ns;
+    os << "    \"" << name << "\": {"
+       << "\"count\": " << h.count()
+       << ", \"misses\": " << op.misses
+       << ", \"throughput\": " << (seconds > 0 ? h.count() / seconds : 0)
+       << ", \"mean_ns\": " << h.mean()
+       << ", \"p50_ns\": " << h.percentile(50)
+       << ", \"p99_ns\": " << h.percentile(99)
+       << ", \"p999_ns\": " << h.percentile(99.9)
+       << ", \"max_ns\": " << h.max()
+       << "}";
+}
+
+std::string report(const WorkerStats& total, double seconds) {
+    std::ostringstream os;
+    uint64_t ops = total.get.latency_ns.count() + total.put.latency_ns.count();
+    os << "{\n"
+       << "  \"target\": \"" << FLAGS_bench_target << "\",\n"
+       << "  \"key_distribution\": \"" << FLAGS_key_distribution << "\",\n"
+       << "  \"zipf_theta\": " << FLAGS_zipf_theta << ",\n"
+       << "  \"key_count\": " << FLAGS_key_count << ",\n"
+       << "  \"value_size\": " << FLAGS_value_size << ",\n"
+       << "  \"read_ratio\": " << FLAGS_read_ratio << ",\n"
+       << "  \"threads\": " << FLAGS_threads << ",\n"
+       << "  \"reclaim_policy\": \"" << FLAGS_reclaim_policy << "\",\n"
+       << "  \"write_mode\": \"" << FLAGS_write_mode << "\",\n"
+       << "  \"seconds\": " << seconds << ",\n"
+       << "  \"throughput\": " << (seconds > 0 ? ops / seconds : 0) << ",\n"
+       << "  \"ops\": {\n";
+    write_op(os, "get", total.get, seconds);
+    os << ",\n";
+    write_op(os, "put", total.put, seconds);
+    os << "\n  }\n}\n";
+    return os.str();
+}
+
+int run() {
+    KeyGenerator::Distribution dist;
+    if (KeyGenerator::parse_distribution(FLAGS_key_distribution, &dist) != 0) {
+        LOG(ERROR) << "unknown key_distribution:" << FLAGS_key_distribution;
+        return -1;
+    }
+    if (FLAGS_key_count <= 0 || FLAGS_threads <= 0 || FLAGS_value_size < 0) {
+        LOG(ERROR) << "invalid key_count, threads or value_size";
+        return -1;
+    }
+    if (dist == KeyGenerator::ZIPFIAN && (FLAGS_zipf_theta <= 0 || FLAGS_zipf_theta >= 1)) {
+        LOG(ERROR) << "invalid zipf_theta:" << FLAGS_zipf_theta;
+        return -1;
+    }
+    std::unique_ptr<Target> target;
+    if (FLAGS_bench_target == "skiplist") {
+        target.reset(new SkipListTarget);
+    } else if (FLAGS_bench_target == "service") {
+        target.reset(new ServiceTarget);
+    } else {
+        LOG(ERROR) << "unknown bench_target:" << FLAGS_bench_target;
+        return -1;
+    }
+    if (target->start() != 0) {
+        LOG(ERROR) << "Fail to start " << FLAGS_bench_target;
+        return -1;
+    }
+
+    // every key exists before measuring, so gets only miss on failures
+    std::atomic<bool> load_failed(false);
+    std::vector<std::thread> loaders;
+    for (int i = 0; i < FLAGS_threads; ++i) {
+        loaders.emplace_back([&target, &load_failed, i]() {
+            std::string value(FLAGS_value_size, 'v');
+            for (int key = i; key < FLAGS_key_count; key += FLAGS_threads) {
+                if (!target->put(key, value)) {
+                    load_failed.store(true);
+                    return;
+                }
+            }
+        });
+    }
+    for (auto& loader : loaders) {
+        loader.join();
+    }
+    if (load_failed.load()) {
+        LOG(ERROR) << "Fail to load " << FLAGS_key_count << " keys";
+        return -1;
+    }
+
+    KeyGenerator keys(dist, FLAGS_key_count, FLAGS_zipf_theta);
+    std::atomic<int> phase(WARMUP);
+    std::vector<WorkerStats> stats(FLAGS_threads);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < FLAGS_threads; ++i) {
+        workers.emplace_back(run_worker, target.get(), keys.fork(i, FLAGS_threads), i,
+                &phase, &stats[i]);
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(FLAGS_warmup_s));
+    int64_t start = base::monotonic_time_ns();
+    phase.store(MEASURE, std::memory_order_relaxed);
+    std::this_thread::sleep_for(std::chrono::seconds(FLAGS_duration_s));
+    phase.store(STOP, std::memory_order_relaxed);
+    double seconds = (base::monotonic_time_ns() - start) / 1e9;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    WorkerStats total;
+    for (auto& s : stats) {
+        total.get.latency_ns.merge(s.get.latency_ns);
+        total.get.misses += s.get.misses;
+        total.put.latency_ns.merge(s.put.latency_ns);
+        total.put.misses += s.put.misses;
+    }
+    std::string json = report(total, seconds);
+    if (FLAGS_output.empty()) {
+        std::cout << json;
+        return 0;
+    }
+    std::ofstream out(FLAGS_output.c_str());
+    out << json;
+    if (!out) {
+        LOG(ERROR) << "Fail to write " << FLAGS_output;
+        return -1;
+    }
+    return 0;
+}
+}
+}
+
+int main(int argc, char* argv[]) {
+    // runs start from an empty store and measure the memory path only,
+    // pass the flags explicitly to include the wal or snapshots
+    google::SetCommandLineOptionWithMode("dump_file", "", google::SET_FLAGS_DEFAULT);
+    google::SetCommandLineOptionWithMode("wal_path", "", google::SET_FLAGS_DEFAULT);
+    google::SetCommandLineOptionWithMode("snapshot_interval_s", "0", google::SET_FLAGS_DEFAULT);
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    return kvservice::run() == 0 ? 0 : 1;
+}
@@ -1,10 +1,23 @@
 #include <gflags/gflags.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
 #include <base/logging.h>
 #include <base/time.h>
 #include <baidu/rpc/channel.h>
 #include <baidu/rpc/policy/giano_authenticator.h>
 #include "baidu/personal-code/fengjialin-kv-server/proto/kvservice.pb.h"
+#include "histogram.h"
+#include "key_generator.h"
 
 DEFINE_string(protocol, "baidu_std", "Protocol type. Defined in protocol/baidu/rpc/options.proto");
 DEFINE_string(connection_type, "", "Connection type. Available values: single, pooled, short");
@@ -12,90 +25,324 @@ DEFINE_string(server, "0.0.0.0:8666", "IP Address of server");
 DEFINE_string(load_balancer, "", "The algorithm for load balancing");
 DEFINE_int32(timeout_ms, 100, "RPC timeout in milliseconds");
 DEFINE_int32(max_retry, 3, "Max retries(not including the first RPC)");
-DEFINE_int32(interval_ms, 1000, "Milliseconds between consecutive requests");
+DEFINE_int32(channels, 1, "channels to the server, threads are spread over them");
+DEFINE_int32(threads, 4, "threads sending requests");
+DEFINE_int32(qps, 0, "total requests per second sent on a fixed schedule whatever the "
+        "responses(open loop), 0 sends as soon as a request finishes(closed loop)");
+DEFINE_int32(concurrency, 16, "max requests in flight per thread");
+DEFINE_string(key_distribution, "uniform", "key distribution: uniform, zipfian or sequential");
+DEFINE_double(zipf_theta, 0.99, "skew of the zipfian distribution, in (0, 1)");
+DEFINE_int32(key_count, 1000000, "keys are drawn from [0, key_count)");
+DEFINE_int32(value_size, 100, "bytes per put value");
+DEFINE_double(read_ratio, 0.9, "fraction of gets");
+DEFINE_double(remove_ratio, 0, "fraction of removes, the other requests are puts");
+DEFINE_bool(preload, true, "put every key with multi_put before the run");
+DEFINE_int32(warmup_s, 1, "seconds run before measuring");
+DEFINE_int32(duration_s, 10, "seconds measured");
+DEFINE_string(output, "", "file the json report is written to, stdout if empty");
+
+namespace {
+
+enum Op {
+    GET,
+    PUT,
+    REMOVE,
+    OP_COUNT,
+};
+
+const char* const OP_NAMES[OP_COUNT] = {"get", "put", "remove"};
+
+enum Phase {
+    WARMUP,
+    MEASURE,
+    STOP,
+};
+
+struct OpStats {
+    kvservice::Histogram latency_ns;
+    // 404 of gets and removes
+    uint64_t misses = 0;
+    // rpc failures and 500s, not in the histogram
+    uint64_t errors = 0;
+    // 503s, writes the server turned away because its queue was full
+    uint64_t rejected = 0;
+};
+
+class Sender;
+
+// one async request, deleted once its response is counted
+struct Call : public google::protobuf::Closure {
+    void Run() override;
+
+    Sender* sender;
+    Op op;
+    // when the request should have been sent, latency is measured from it
+    // so a stalled server can't hide the requests it delayed
+    int64_t start_ns;
+    bool measured;
+    baidu::rpc::Controller cntl;
+    kvservice::GetRequest get_request;
+    kvservice::PutRequest put_request;
+    kvservice::RemoveRequest remove_request;
+    kvservice::CommonResponse response;
+};
+
+// Requests of one thread. In open loop mode each request has its slot on
+// a fixed schedule, when concurrency requests are in flight the thread
+// waits and the delay counts in the latency of the late ones.
+class Sender {
+public:
+    Sender(kvservice::KVService_Stub* stub, kvservice::KeyGenerator keys, int index,
+            const std::atomic<int>* phase)
+        : _stub(stub), _keys(keys), _rng(index + 1), _phase(phase)
+        , _value(FLAGS_value_size, 'v') { }
+
+    void run() {
+        int64_t interval = FLAGS_qps > 0
+            ? static_cast<int64_t>(1e9 * FLAGS_threads / FLAGS_qps) : 0;
+        int64_t next = base::monotonic_time_ns();
+        int current;
+        while ((current = _phase->load(std::memory_order_relaxed)) != STOP) {
+            if (interval > 0) {
+                int64_t wait = next - base::monotonic_time_ns();
+                if (wait > 0) {
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+                }
+            }
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cond.wait(lock, [this]{return _inflight < FLAGS_concurrency;});
+                ++_inflight;
+            }
+            int64_t start = interval > 0 ? next : base::monotonic_time_ns();
+            next += interval;
+            send(start, current == MEASURE);
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cond.wait(lock, [this]{return _inflight == 0;});
+    }
+
+    void finish(Call* call) {
+        int64_t latency = base::monotonic_time_ns() - call->start_ns;
+        std::lock_guard<std::mutex> lk(_mutex);
+        if (call->measured) {
+            OpStats& op = _stats[call->op];
+            if (call->cntl.Failed() || call->response.code() == 500) {
+                ++op.errors;
+            } else if (call->response.code() == 503) {
+                ++op.rejected;
+            } else {
+                op.latency_ns.record(latency);
+                if (call->response.code() == 404) {
+                    ++op.misses;
+                }
+            }
+        }
+        --_inflight;
+        _cond.notify_one();
+    }
+
+    // only after run() returned
+    const OpStats& stats(Op op) const {
+        return _stats[op];
+    }
+private:
+    void send(int64_t start, bool measured) {
+        Call* call = new Call;
+        call->sender = this;
+        call->start_ns = start;
+        call->measured = measured;
+        int key = static_cast<int>(_keys.next());
+        double r = std::uniform_real_distribution<double>(0, 1)(_rng);
+        if (r < FLAGS_read_ratio) {
+            call->op = GET;
+            call->get_request.set_key(key);
+            _stub->get(&call->cntl, &call->get_request, &call->response, call);
+        } else if (r < FLAGS_read_ratio + FLAGS_remove_ratio) {
+            call->op = REMOVE;
+            call->remove_request.set_key(key);
+            _stub->remove(&call->cntl, &call->remove_request, &call->response, call);
+        } else {
+            call->op = PUT;
+            call->put_request.set_key(key);
+            call->put_request.set_value(_value);
+            _stub->put(&call->cntl, &call->put_request, &call->response, call);
+        }
+    }
+
+    kvservice::KVService_Stub* _stub;
+    kvservice::KeyGenerator _keys;
+    std::mt19937_64 _rng;
+    const std::atomic<int>* _phase;
+    std::string _value;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    int _inflight = 0;
+    OpStats _stats[OP_COUNT];
+};
+
+void Call::Run() {
+    sender->finish(this);
+    delete this;
+}
+
+// fills [0, key_count) so gets hit, 1000 keys per call
+int preload(kvservice::KVService_Stub* stub) {
+    std::string value(FLAGS_value_size, 'v');
+    for (int begin = 0; begin < FLAGS_key_count; begin += 1000) {
+        baidu::rpc::Controller cntl;
+        kvservice::MultiPutRequest request;
+        kvservice::CommonResponse response;
+        for (int key = begin; key < FLAGS_key_count && key < begin + 1000; ++key) {
+            kvservice::KeyValue* kv = request.add_kvs();
+            kv->set_key(key);
+            kv->set_value(value);
+        }
+        stub->multi_put(&cntl, &request, &response, NULL);
+        // a full write queue is retried, the puts are idempotent
+        while (!cntl.Failed() && response.code() == 503) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            cntl.Reset();
+            stub->multi_put(&cntl, &request, &response, NULL);
+        }
+        if (cntl.Failed() || response.code() != 200) {
+            LOG(ERROR) << "Fail to preload keys from " << begin << ": "
+                       << (cntl.Failed() ? cntl.ErrorText() : response.messages());
+            return -1;
+        }
+    }
+    return 0;
+}
+
+std::string report(const OpStats* total, double seconds) {
+    std::ostringstream os;
+    uint64_t ops = 0;
+    for (int i = 0; i < OP_COUNT; ++i) {
+        ops += total[i].latency_ns.count();
+    }
+    os << "{\n"
+       << "  \"server\": \"" << FLAGS_server << "\",\n"
+       << "  \"mode\": \"" << (FLAGS_qps > 0 ? "open" : "closed") << "\",\n"
+       << "  \"target_qps\": " << FLAGS_qps << ",\n"
+       << "  \"channels\": " << FLAGS_channels << ",\n"
+       << "  \"threads\": " << FLAGS_threads << ",\n"
+       << "  \"concurrency\": " << FLAGS_concurrency << ",\n"
+       << "  \"key_distribution\": \"" << FLAGS_key_distribution << "\",\n"
+       << "  \"zipf_theta\": " << FLAGS_zipf_theta << ",\n"
+       << "  \"key_count\": " << FLAGS_key_count << ",\n"
+       << "  \"value_size\": " << FLAGS_value_size << ",\n"
+       << "  \"read_ratio\": " << FLAGS_read_ratio << ",\n"
+       << "  \"remove_ratio\": " << FLAGS_remove_ratio << ",\n"
+       << "  \"seconds\": " << seconds << ",\n"
+       << "  \"throughput\": " << (seconds > 0 ? ops / seconds : 0) << ",\n"
+       << "  \"ops\": {\n";
+    for (int i = 0; i < OP_COUNT; ++i) {
+        const kvservice::Histogram& h = total[i].latency_ns;
+        os << "    \"" << OP_NAMES[i] << "\": {"
+           << "\"count\": " << h.count()
+           << ", \"misses\": " << total[i].misses
+           << ", \"errors\": " << total[i].errors
+           << ", \"rejected\": " << total[i].rejected
+           << ", \"throughput\": " << (seconds > 0 ? h.count() / seconds : 0)
+           << ", \"mean_ns\": " << h.mean()
+           << ", \"p50_ns\": " << h.percentile(50)
+           << ", \"p99_ns\": " << h.percentile(99)
+           << ", \"p999_ns\": " << h.percentile(99.9)
+           << ", \"max_ns\": " << h.max()
+           << "}" << (i + 1 < OP_COUNT ? ",\n" : "\n");
+    }
+    os << "  }\n}\n";
+    return os.str();
+}
+}
 
 int main(int argc, char* argv[]) {
     // Parse gflags. We recommend you to use gflags as well.
     google::ParseCommandLineFlags(&argc, &argv, true);
 
+    kvservice::KeyGenerator::Distribution dist;
+    if (kvservice::KeyGenerator::parse_distribution(FLAGS_key_distribution, &dist) != 0) {
+        LOG(ERROR) << "unknown key_distribution:" << FLAGS_key_distribution;
+        return -1;
+    }
+    if (FLAGS_channels <= 0 || FLAGS_threads <= 0 || FLAGS_concurrency <= 0
+            || FLAGS_key_count <= 0 || FLAGS_qps < 0) {
+        LOG(ERROR) << "invalid channels, threads, concurrency, key_count or qps";
+        return -1;
+    }
+    if (dist == kvservice::KeyGenerator::ZIPFIAN
+            && (FLAGS_zipf_theta <= 0 || FLAGS_zipf_theta >= 1)) {
+        LOG(ERROR) << "invalid zipf_theta:" << FLAGS_zipf_theta;
+        return -1;
+    }
+
     // Login to get `CredentialGenerator' (see baas-lib-c/baas.h for more
     // information) and then pass it to `GianoAuthenticator'.
     std::unique_ptr<baidu::rpc::policy::GianoAuthenticator> auth;
 
-    // A Channel represents a communication line to a Server. Notice that
-    // Channel is thread-safe and can be shared by all threads in your program.
-    baidu::rpc::Channel channel;
-
-    // Initialize the channel, NULL means using default options.
+    // A Channel is thread-safe, more of them spread the requests over
+    // more connections when connection_type is single.
     baidu::rpc::ChannelOptions options;
     options.protocol = FLAGS_protocol;
     options.connection_type = FLAGS_connection_type;
     options.auth = auth.get();
     options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
     options.max_retry = FLAGS_max_retry;
-    if (channel.Init(FLAGS_server.c_str(), FLAGS_load_balancer.c_str(), &options) != 0) {
-        LOG(ERROR) << "Fail to initialize channel";
+    std::vector<std::unique_ptr<baidu::rpc::Channel>> channels;
+    std::vector<std::unique_ptr<kvservice::KVService_Stub>> stubs;
+    for (int i = 0; i < FLAGS_channels; ++i) {
+        channels.emplace_back(new baidu::rpc::Channel);
+        if (channels.back()->Init(FLAGS_server.c_str(), FLAGS_load_balancer.c_str(),
+                    &options) != 0) {
+            LOG(ERROR) << "Fail to initialize channel";
+            return -1;
+        }
+        stubs.emplace_back(new kvservice::KVService_Stub(channels.back().get()));
+    }
+    if (FLAGS_preload && preload(stubs[0].get()) != 0) {
         return -1;
     }
 
-    kvservice::KVService_Stub stub(&channel);
-    {
-        baidu::rpc::Controller cntl;
-        kvservice::PutRequest request;
-        kvservice::CommonResponse response;
-        
-        request.set_key(1);
-        request.set_value("a");
-        request.set_request_id("1");
-
-        stub.put(&cntl, &request, &response, NULL);
-        if (!cntl.Failed()) {
-            LOG(INFO) << "Received response from " << cntl.remote_side()
-                      << "\tcode:" << response.code()
-                      << "\tmessages:" << response.messages()
-                      << "\tlatency=" << cntl.latency_us() << "us";
-        } else {
-            LOG(WARNING) << cntl.ErrorText();
-        }
+    kvservice::KeyGenerator keys(dist, FLAGS_key_count, FLAGS_zipf_theta);
+    std::atomic<int> phase(WARMUP);
+    std::vector<std::unique_ptr<Sender>> senders;
+    for (int i = 0; i < FLAGS_threads; ++i) {
+        senders.emplace_back(new Sender(stubs[i % FLAGS_channels].get(),
+                    keys.fork(i, FLAGS_threads), i, &phase));
     }
-    {
-        baidu::rpc::Controller cntl;
-        kvservice::GetRequest request;
-        kvservice::CommonResponse response;
-        
-        request.set_key(1);
-        request.set_request_id("2");
-
-        stub.get(&cntl, &request, &response, NULL);
-        if (!cntl.Failed()) {
-            LOG(INFO) << "Received response from " << cntl.remote_side()
-                      << "\tcode:" << response.code()
-                      << "\tmessages:" << response.messages()
-                      << "\tvalue:" << response.value()
-                      << "\tlatency=" << cntl.latency_us() << "us";
-        } else {
-            LOG(WARNING) << cntl.ErrorText();
-        }
+    std::vector<std::thread> threads;
+    for (auto& sender : senders) {
+        threads.emplace_back([&sender]() { sender->run(); });
     }
-    {
-        baidu::rpc::Controller cntl;
-        kvservice::RemoveRequest request;
-        kvservice::CommonResponse response;
-        
-        request.set_key(1);
-        request.set_request_id("3");
-
-        stub.remove(&cntl, &request, &response, NULL);
-        if (!cntl.Failed()) {
-            LOG(INFO) << "Received response from " << cntl.remote_side()
-                      << "\tcode:" << response.code()
-                      << "\tmessages:" << response.messages()
-                      << "\tlatency=" << cntl.latency_us() << "us";
-        } else {
-            LOG(WARNING) << cntl.ErrorText();
-        }
+    std::this_thread::sleep_for(std::chrono::seconds(FLAGS_warmup_s));
+    int64_t start = base::monotonic_time_ns();
+    phase.store(MEASURE, std::memory_order_relaxed);
+    std::this_thread::sleep_for(std::chrono::seconds(FLAGS_duration_s));
+    phase.store(STOP, std::memory_order_relaxed);
+    double seconds = (base::monotonic_time_ns() - start) / 1e9;
+    for (auto& thread : threads) {
+        thread.join();
     }
 
-    LOG(INFO) << "EchoClient is going to quit";
+    OpStats total[OP_COUNT];
+    for (auto& sender : senders) {
+        for (int i = 0; i < OP_COUNT; ++i) {
+            total[i].latency_ns.merge(sender->stats(static_cast<Op>(i)).latency_ns);
+            total[i].misses += sender->stats(static_cast<Op>(i)).misses;
+            total[i].errors += sender->stats(static_cast<Op>(i)).errors;
+            total[i].rejected += sender->stats(static_cast<Op>(i)).rejected;
+        }
+    }
+    std::string json = report(total, seconds);
+    if (FLAGS_output.empty()) {
+        std::cout << json;
+        return 0;
+    }
+    std::ofstream out(FLAGS_output.c_str());
+    out << json;
+    if (!out) {
+        LOG(ERROR) << "Fail to write " << FLAGS_output;
+        return -1;
+    }
     return 0;
 }
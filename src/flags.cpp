@@ -0,0 +1,46 @@
+#include <gflags/gflags.h>
+
+// flags of the kv service, shared by the server and the benchmark
+DEFINE_string(dump_file, "./dump", "kv dump file path, empty disables dumps and snapshots");
+DEFINE_int32(shard_num, 1, "number of keyspace shards, each one has its own writer thread");
+DEFINE_string(shard_policy, "hash", "how keys are routed to shards: hash or range");
+DEFINE_string(key_type, "int64", "type of the keys: int64(key fields) or string(string_key "
+        "fields, ordered like memcmp), the dump and wal are only valid for one of them");
+DEFINE_int32(write_batch_size, 256, "max writes applied by a writer thread per wakeup");
+DEFINE_int32(write_batch_wait_us, 0, "max time a writer waits for a batch to fill, 0 means no wait");
+DEFINE_int32(write_queue_size, 4096, "capacity of the write queue of a shard, rounded up to a power "
+        "of 2; writes beyond it are rejected with code 503");
+DEFINE_int32(write_queue_full_wait_us, 0, "how long a write waits for room in a full write queue "
+        "before it is rejected, 0 rejects at once");
+DEFINE_int32(writer_spin_us, 20, "how long an idle writer thread polls its queue before sleeping, "
+        "producers skip the wakeup while it polls");
+DEFINE_string(wal_path, "./wal", "write ahead log path prefix, empty disables the wal");
+DEFINE_string(wal_sync_policy, "always", "when wal is fsynced before writes are acknowledged: "
+        "always(every batch), interval(every wal_sync_interval_ms) or none");
+DEFINE_int32(wal_sync_interval_ms, 10, "fsync interval of the interval wal_sync_policy");
+DEFINE_string(value_log_path, "", "value log path prefix, values of at least value_log_threshold "
+        "bytes are kept there instead of in memory; empty disables it. A dump is only valid with "
+        "the value log it was taken with, or without one");
+DEFINE_int32(value_log_threshold, 4096, "values of at least this many bytes go to the value log");
+DEFINE_int32(value_log_segment_mb, 256, "size a value log segment is sealed at");
+DEFINE_int32(value_log_gc_interval_s, 60, "seconds between value log compactions, 0 disables them");
+DEFINE_double(value_log_gc_ratio, 0.5, "share of dead bytes a sealed value log segment is "
+        "compacted at, in (0, 1]");
+DEFINE_int32(scan_max_limit, 10000, "max keys returned by one scan call");
+DEFINE_int32(snapshot_interval_s, 3600, "seconds between online snapshots, 0 disables them");
+DEFINE_string(reclaim_policy, "epoch", "how removed nodes are freed behind readers: "
+        "epoch or hazard(pointers)");
+DEFINE_bool(background_gc, true, "free removed nodes on a reclaimer thread per shard instead of "
+        "the writer thread");
+DEFINE_int64(bloom_filter_keys, 0, "keys per shard the bloom filter in front of gets is sized for, "
+        "0 disables it");
+DEFINE_int64(hash_index_keys, 0, "keys per shard the hash index serving gets is first sized for, it "
+        "grows as needed; 0 disables it");
+DEFINE_int32(ttl_check_interval_ms, 100, "how often a writer thread looks for expired keys");
+DEFINE_int32(ttl_expire_batch, 1000, "max expired keys a writer thread handles between two batches "
+        "of writes");
+DEFINE_int64(memory_limit_mb, 0, "memory budget of all the skiplists, split evenly over shards; "
+        "over it writers evict keys not read lately, 0 means no limit");
+DEFINE_string(write_mode, "queue", "how writes reach a skiplist: queue(one writer thread per shard, "
+        "group commit) or direct(applied by the rpc thread with CAS, needs the epoch "
+        "reclaim_policy, no wal, bloom filter, memory limit or online snapshots)");
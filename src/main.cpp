@@ -10,10 +10,9 @@
 #include "server.h"
 
 DEFINE_int32(port, 8666, "kv server port");
-DEFINE_string(dump_file, "./dump", "kv dump file path");
+
 int main(int argc, char* argv[]) {
-    (void)argc;
-    (void)argv;
+    google::ParseCommandLineFlags(&argc, &argv, true);
     baidu::rpc::Server server;
     kvservice::KVServiceImpl kv_service;
     if (kv_service.start() != 0) {
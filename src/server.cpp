@@ -1,67 +1,211 @@
+#include <algorithm>
 #include <fstream>
 #include "server.h"
 DECLARE_string(dump_file);
+DECLARE_int32(shard_num);
+DECLARE_string(shard_policy);
+DECLARE_string(key_type);
+DECLARE_string(wal_path);
+DECLARE_string(value_log_path);
+DECLARE_int32(snapshot_interval_s);
+DECLARE_string(write_mode);
+DECLARE_int32(scan_max_limit);
 
 namespace kvservice {
 
+// the stored key of a request, false if it lacks the field of the key type
+template <typename R>
+static bool request_key(const R& request, bool string_keys, skiplist::ByteKey* key) {
+    if (string_keys) {
+        if (!request.has_string_key()) {
+            return false;
+        }
+        *key = skiplist::ByteKey(request.string_key());
+    } else {
+        if (!request.has_key()) {
+            return false;
+        }
+        *key = skiplist::ByteKey::from_int64(request.key());
+    }
+    return true;
+}
+
 int KVServiceImpl::stop() {
     {
-        std::lock_guard<std::mutex> lk(_mutex);
-        if (!_stop) {
-            _stop = true;
-        }
+        std::lock_guard<std::mutex> lk(_timer_mutex);
+        _timer_stop = true;
+    }
+    _timer_cond.notify_one();
+    if (_snapshot_timer.joinable()) {
+        _snapshot_timer.join();
     }
-    _cond.notify_one();
-    _write_thread.join();
-    if (_skip_list) {
-        _skip_list->dump(FLAGS_dump_file);
-        delete _skip_list;
-        _skip_list = nullptr;
+    for (auto& shard : _shards) {
+        shard->stop();
     }
+    _shards.clear();
     return 0;
 }
 
 int KVServiceImpl::start() {
-    int ret = 0;
-    _stop = false;
-    _write_cnt = 0;
-    _skip_list = new skiplist::SkipList<int, std::string>(0x7fffffff);
-    _skip_list->load(FLAGS_dump_file);
-
-    // start write thread, no read thread
-    _write_thread = std::thread([this](){ this->write_loop(); });
-    return ret;
+    if (FLAGS_shard_num <= 0) {
+        LOG(ERROR) << "invalid shard_num:" << FLAGS_shard_num;
+        return -1;
+    }
+    if (FLAGS_shard_policy == "range") {
+        _range_policy = true;
+    } else if (FLAGS_shard_policy == "hash") {
+        _range_policy = false;
+    } else {
+        LOG(ERROR) << "unknown shard_policy:" << FLAGS_shard_policy;
+        return -1;
+    }
+    if (FLAGS_key_type == "int64") {
+        _string_keys = false;
+    } else if (FLAGS_key_type == "string") {
+        _string_keys = true;
+    } else {
+        LOG(ERROR) << "unknown key_type:" << FLAGS_key_type;
+        return -1;
+    }
+
+    for (int i = 0; i < FLAGS_shard_num; ++i) {
+        // keep the plain dump file name when not sharded
+        std::string dump_file = FLAGS_dump_file;
+        std::string wal_file = FLAGS_wal_path;
+        std::string value_log_file = FLAGS_value_log_path;
+        if (FLAGS_shard_num > 1) {
+            if (!dump_file.empty()) {
+                dump_file += "." + std::to_string(i);
+            }
+            if (!wal_file.empty()) {
+                wal_file += "." + std::to_string(i);
+            }
+            if (!value_log_file.empty()) {
+                value_log_file += "." + std::to_string(i);
+            }
+        }
+        _shards.emplace_back(new KVShard(i, dump_file, wal_file, value_log_file));
+        if (_shards.back()->start() != 0) {
+            LOG(ERROR) << "Fail to start shard " << i;
+            stop();
+            return -1;
+        }
+    }
+
+    _timer_stop = false;
+    // shards in direct write mode only dump at stop
+    if (FLAGS_snapshot_interval_s > 0 && FLAGS_write_mode != "direct") {
+        _snapshot_timer = std::thread([this](){ this->snapshot_loop(); });
+    }
+    return 0;
+}
+
+void KVServiceImpl::snapshot_loop() {
+    std::unique_lock<std::mutex> lock(_timer_mutex);
+    while (!_timer_cond.wait_for(lock, std::chrono::seconds(FLAGS_snapshot_interval_s),
+                [this]{return _timer_stop;})) {
+        for (auto& shard : _shards) {
+            if (shard->snapshot() != 0) {
+                LOG(WARNING) << "shard " << shard->id() << " is still taking a snapshot";
+            }
+        }
+    }
+}
+
+KVShard* KVServiceImpl::route(const skiplist::ByteKey& key) {
+    uint64_t n = _shards.size();
+    if (n == 1) {
+        return _shards[0].get();
+    }
+    if (_range_policy) {
+        // split the key space into n equal continuous ranges by the first
+        // 8 bytes of the keys, the whole int64 range for int64 keys
+        return _shards[static_cast<unsigned __int128>(key.prefix()) * n >> 64].get();
+    }
+    uint64_t h;
+    if (_string_keys) {
+        h = std::hash<std::string>()(key.bytes());
+    } else {
+        // int32 keys stay in the shard older versions put them in
+        int64_t v = key.to_int64();
+        h = static_cast<uint32_t>(v)
+            | static_cast<uint64_t>(static_cast<uint32_t>((v >> 32) ^ (v >> 63))) << 32;
+    }
+    // fmix64 of murmur3, spread sequential keys over all shards
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return _shards[h % n].get();
 }
 
 void KVServiceImpl::get(::google::protobuf::RpcController* cntl_base,
         const GetRequest* request,
         CommonResponse* response,
         ::google::protobuf::Closure* done) {
-    (void)cntl_base;
+    baidu::rpc::Controller* cntl = static_cast<baidu::rpc::Controller*>(cntl_base);
     baidu::rpc::ClosureGuard done_guard(done);
-    std::string value;
-    bool result = _skip_list->search(request->key(), value);
-    if (result) {
+    response->set_request_id(request->request_id());
+    skiplist::ByteKey key;
+    if (!request_key(*request, _string_keys, &key)) {
+        response->set_code(400);
+        response->set_messages("missing key");
+        return;
+    }
+    // refers to the blocks of the stored value, nothing is copied yet
+    base::IOBuf value;
+    int result = route(key)->get(key, &value);
+    if (result < 0) {
+        response->set_messages("value log read failed");
+        response->set_code(500);
+    } else if (result > 0) {
         response->set_messages("success");
         response->set_code(200);
-        response->set_value(value);
+        if (request->value_in_attachment()) {
+            cntl->response_attachment().append(value);
+        } else {
+            response->set_value(value.to_string());
+        }
     } else {
         response->set_messages("not found");
         response->set_code(404);
     }
-    response->set_request_id(request->request_id());
 }
 
 void KVServiceImpl::put(::google::protobuf::RpcController* cntl_base,
         const PutRequest* request,
         CommonResponse* response,
         ::google::protobuf::Closure* done) {
-    (void)cntl_base;
+    baidu::rpc::Controller* cntl = static_cast<baidu::rpc::Controller*>(cntl_base);
     baidu::rpc::ClosureGuard done_guard(done);
+    skiplist::ByteKey key;
+    if (!request_key(*request, _string_keys, &key)) {
+        response->set_code(400);
+        response->set_messages("missing key");
+        response->set_request_id(request->request_id());
+        return;
+    }
+    KVShard* shard = route(key);
+    WriteTask* task = new WriteTask(WriteTask::PUT, key);
+    if (!cntl->request_attachment().empty()) {
+        task->value.swap(cntl->request_attachment());
+    } else {
+        task->value.append(request->value());
+    }
+    if (request->ttl_ms() > 0) {
+        task->expire_ms = skiplist::wall_time_ms() + request->ttl_ms();
+    }
     auto l = [=]() {
+        std::unique_ptr<WriteTask> task_guard(task);
         baidu::rpc::ClosureGuard done_guard(done);
-        bool result = _skip_list->insert(request->key(), request->value());
-        if (result) {
+        if (task->io_error) {
+            response->set_code(500);
+            response->set_messages("disk write failed");
+        } else if (task->rejected) {
+            response->set_code(503);
+            response->set_messages("write queue full, retry later");
+        } else if (task->result) {
             response->set_code(200);
             response->set_messages("success");
         } else {
@@ -70,13 +214,8 @@ void KVServiceImpl::put(::google::protobuf::RpcController* cntl_base,
         }
         response->set_request_id(request->request_id());
     };
-    auto closure = create_closure(std::move(l));
-    _queue.push(closure);
-    {
-        std::lock_guard<std::mutex> lk(_mutex);
-        _write_cnt++;
-    }
-    _cond.notify_one();
+    task->done = create_closure(std::move(l));
+    shard->submit(task);
     done_guard.release();
 }
 
@@ -86,11 +225,25 @@ void KVServiceImpl::remove(::google::protobuf::RpcController* cntl_base,
         ::google::protobuf::Closure* done) {
     (void)cntl_base;
     baidu::rpc::ClosureGuard done_guard(done);
+    skiplist::ByteKey key;
+    if (!request_key(*request, _string_keys, &key)) {
+        response->set_code(400);
+        response->set_messages("missing key");
+        response->set_request_id(request->request_id());
+        return;
+    }
+    KVShard* shard = route(key);
+    WriteTask* task = new WriteTask(WriteTask::REMOVE, key);
     auto l = [=]() {
+        std::unique_ptr<WriteTask> task_guard(task);
         baidu::rpc::ClosureGuard done_guard(done);
-        std::string value;
-        bool result = _skip_list->remove(request->key(), value);
-        if (result) {
+        if (task->io_error) {
+            response->set_code(500);
+            response->set_messages("disk write failed");
+        } else if (task->rejected) {
+            response->set_code(503);
+            response->set_messages("write queue full, retry later");
+        } else if (task->result) {
             response->set_code(200);
             response->set_messages("success");
         } else {
@@ -99,37 +252,272 @@ void KVServiceImpl::remove(::google::protobuf::RpcController* cntl_base,
         }
         response->set_request_id(request->request_id());
     };
-    auto closure = create_closure(std::move(l));
-    _queue.push(closure);
-    {
-        std::lock_guard<std::mutex> lk(_mutex);
-        _write_cnt++;
-    }
-    _cond.notify_one();
+    task->done = create_closure(std::move(l));
+    shard->submit(task);
     done_guard.release();
 }
 
-void KVServiceImpl::write_loop() {
-    while (true) {
-        {
-            std::unique_lock<std::mutex> lock(_mutex);
-            _cond.wait(lock, [&]{return _write_cnt || _stop;});
+void KVServiceImpl::multi_get(::google::protobuf::RpcController* cntl_base,
+        const MultiGetRequest* request,
+        MultiGetResponse* response,
+        ::google::protobuf::Closure* done) {
+    (void)cntl_base;
+    baidu::rpc::ClosureGuard done_guard(done);
+    // keys of the other key type are a client error, like in get
+    if ((_string_keys ? request->keys_size() : request->string_keys_size()) > 0) {
+        response->set_code(400);
+        response->set_messages("missing key");
+        response->set_request_id(request->request_id());
+        return;
+    }
+    // (key, position in request) grouped by shard, looked up in key order
+    std::vector<std::vector<std::pair<skiplist::ByteKey, int>>> groups(_shards.size());
+    int count = _string_keys ? request->string_keys_size() : request->keys_size();
+    for (int i = 0; i < count; ++i) {
+        skiplist::ByteKey key = _string_keys ? skiplist::ByteKey(request->string_keys(i))
+            : skiplist::ByteKey::from_int64(request->keys(i));
+        KVShard* shard = route(key);
+        groups[shard->id()].emplace_back(std::move(key), i);
+        response->add_results()->set_code(404);
+    }
+    std::vector<skiplist::ByteKey> keys;
+    std::vector<base::IOBuf> values;
+    std::vector<bool> found;
+    for (size_t s = 0; s < groups.size(); ++s) {
+        auto& group = groups[s];
+        if (group.empty()) {
+            continue;
+        }
+        std::sort(group.begin(), group.end(),
+                [](const std::pair<skiplist::ByteKey, int>& a,
+                    const std::pair<skiplist::ByteKey, int>& b) {
+                    return a.first < b.first;
+                });
+        keys.clear();
+        for (auto& item : group) {
+            keys.push_back(item.first);
         }
-        // handle request in queue
-        ::google::protobuf::Closure* done;
-        while (_queue.pop(done)) {
+        _shards[s]->skip_list()->multi_search(keys, values, found);
+        for (size_t j = 0; j < group.size(); ++j) {
+            if (!found[j]) {
+                continue;
+            }
+            GetResult* result = response->mutable_results(group[j].second);
+            int ret = _shards[s]->resolve(keys[j], &values[j]);
+            if (ret < 0) {
+                result->set_code(500);
+            } else if (ret > 0) {
+                result->set_code(200);
+                result->set_value(values[j].to_string());
+            }
+        }
+    }
+    response->set_code(200);
+    response->set_messages("success");
+    response->set_request_id(request->request_id());
+}
+
+void KVServiceImpl::multi_put(::google::protobuf::RpcController* cntl_base,
+        const MultiPutRequest* request,
+        CommonResponse* response,
+        ::google::protobuf::Closure* done) {
+    (void)cntl_base;
+    baidu::rpc::ClosureGuard done_guard(done);
+    response->set_request_id(request->request_id());
+    std::vector<skiplist::ByteKey> keys(request->kvs_size());
+    for (int i = 0; i < request->kvs_size(); ++i) {
+        if (!request_key(request->kvs(i), _string_keys, &keys[i])) {
+            response->set_code(400);
+            response->set_messages("missing key");
+            return;
+        }
+    }
+    // one task per shard, its writer applies it as a single queue item
+    std::vector<WriteTask*> tasks(_shards.size(), nullptr);
+    int task_cnt = 0;
+    for (int i = 0; i < request->kvs_size(); ++i) {
+        KVShard* shard = route(keys[i]);
+        WriteTask*& task = tasks[shard->id()];
+        if (task == nullptr) {
+            task = new WriteTask(WriteTask::MULTI_PUT);
+            ++task_cnt;
+        }
+        task->entries.emplace_back(std::move(keys[i]), base::IOBuf());
+        task->entries.back().second.append(request->kvs(i).value());
+    }
+    if (task_cnt == 0) {
+        response->set_code(200);
+        response->set_messages("success");
+        return;
+    }
+
+    // the last shard to finish responds
+    auto pending = std::make_shared<std::atomic<int>>(task_cnt);
+    auto io_error = std::make_shared<std::atomic<bool>>(false);
+    auto rejected = std::make_shared<std::atomic<bool>>(false);
+    auto failed = std::make_shared<std::atomic<bool>>(false);
+    for (size_t s = 0; s < tasks.size(); ++s) {
+        WriteTask* task = tasks[s];
+        if (task == nullptr) {
+            continue;
+        }
+        // later duplicates of a key stay later, so the last one wins
+        std::stable_sort(task->entries.begin(), task->entries.end(),
+                [](const std::pair<skiplist::ByteKey, base::IOBuf>& a,
+                    const std::pair<skiplist::ByteKey, base::IOBuf>& b) {
+                    return a.first < b.first;
+                });
+        auto l = [=]() {
+            std::unique_ptr<WriteTask> task_guard(task);
+            if (task->io_error) {
+                io_error->store(true);
+            } else if (task->rejected) {
+                rejected->store(true);
+            } else if (!task->result) {
+                failed->store(true);
+            }
+            if (pending->fetch_sub(1) != 1) {
+                return;
+            }
             baidu::rpc::ClosureGuard done_guard(done);
-            {
-                std::lock_guard<std::mutex> lk(_mutex);
-                _write_cnt--;
+            if (io_error->load()) {
+                response->set_code(500);
+                response->set_messages("disk write failed");
+            } else if (rejected->load()) {
+                // the other shards applied their part, a retry puts it again
+                response->set_code(503);
+                response->set_messages("write queue full, retry later");
+            } else if (failed->load()) {
+                response->set_code(404);
+                response->set_messages("multi_put failed");
+            } else {
+                response->set_code(200);
+                response->set_messages("success");
+            }
+        };
+        task->done = create_closure(std::move(l));
+    }
+    done_guard.release();
+    for (size_t s = 0; s < tasks.size(); ++s) {
+        if (tasks[s] != nullptr) {
+            _shards[s]->submit(tasks[s]);
+        }
+    }
+}
+
+void KVServiceImpl::scan(::google::protobuf::RpcController* cntl_base,
+        const ScanRequest* request,
+        ScanResponse* response,
+        ::google::protobuf::Closure* done) {
+    (void)cntl_base;
+    baidu::rpc::ClosureGuard done_guard(done);
+    response->set_request_id(request->request_id());
+    int limit = std::min(request->limit(), FLAGS_scan_max_limit);
+    if (limit <= 0) {
+        response->set_code(400);
+        response->set_messages("invalid limit");
+        return;
+    }
+    // no start key means from the smallest key
+    skiplist::ByteKey start_key;
+    skiplist::ByteKey end_key;
+    bool has_end = false;
+    if (_string_keys) {
+        start_key = skiplist::ByteKey(request->start_string_key());
+        end_key = skiplist::ByteKey(request->end_string_key());
+        has_end = request->has_end_string_key();
+    } else {
+        if (request->has_start_key()) {
+            start_key = skiplist::ByteKey::from_int64(request->start_key());
+        }
+        end_key = skiplist::ByteKey::from_int64(request->end_key());
+        has_end = request->has_end_key();
+    }
+    auto in_range = [&](const KVSkipList::Iterator& it) {
+        return it.valid() && (!has_end || it.key() < end_key);
+    };
+
+    // merge the ordered walks of all shards, each key lives in one shard
+    std::vector<std::unique_ptr<KVSkipList::Iterator>> iters;
+    for (auto& shard : _shards) {
+        iters.emplace_back(new KVSkipList::Iterator(shard->skip_list()));
+        iters.back()->seek(start_key);
+    }
+    // values are read from the value log once the iterators let go of
+    // the nodes
+    std::vector<std::pair<size_t, base::IOBuf>> values;
+    std::vector<skiplist::ByteKey> keys;
+    while (true) {
+        size_t min = iters.size();
+        for (size_t i = 0; i < iters.size(); ++i) {
+            if (in_range(*iters[i]) && (min == iters.size() || iters[i]->key() < iters[min]->key())) {
+                min = i;
             }
         }
-        {
-            std::lock_guard<std::mutex> lk(_mutex);
-            if (_stop) {
-                break;
+        if (min == iters.size()) {
+            break;
+        }
+        if (static_cast<int>(keys.size()) == limit) {
+            if (_string_keys) {
+                response->set_next_string_key(iters[min]->key().bytes());
+            } else {
+                response->set_next_key(iters[min]->key().to_int64());
             }
+            break;
+        }
+        keys.push_back(iters[min]->key());
+        values.emplace_back(min, iters[min]->value());
+        iters[min]->next();
+    }
+    iters.clear();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int ret = _shards[values[i].first]->resolve(keys[i], &values[i].second);
+        if (ret < 0) {
+            response->clear_kvs();
+            response->set_code(500);
+            response->set_messages("value log read failed");
+            return;
+        }
+        if (ret == 0) {
+            // removed meanwhile
+            continue;
         }
+        KeyValue* kv = response->add_kvs();
+        if (_string_keys) {
+            kv->set_string_key(keys[i].bytes());
+        } else {
+            kv->set_key(keys[i].to_int64());
+        }
+        kv->set_value(values[i].second.to_string());
+    }
+    response->set_code(200);
+    response->set_messages("success");
+}
+
+void KVServiceImpl::snapshot(::google::protobuf::RpcController* cntl_base,
+        const SnapshotRequest* request,
+        CommonResponse* response,
+        ::google::protobuf::Closure* done) {
+    (void)cntl_base;
+    baidu::rpc::ClosureGuard done_guard(done);
+    response->set_request_id(request->request_id());
+    if (FLAGS_write_mode == "direct") {
+        response->set_code(400);
+        response->set_messages("no online snapshot in direct write mode");
+        return;
+    }
+    int busy = 0;
+    for (auto& shard : _shards) {
+        if (shard->snapshot() != 0) {
+            ++busy;
+        }
+    }
+    if (busy == 0) {
+        response->set_code(200);
+        response->set_messages("snapshot started");
+    } else {
+        response->set_code(409);
+        response->set_messages(std::to_string(busy) + " shards still taking a snapshot");
     }
 }
 }
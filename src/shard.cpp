@@ -0,0 +1,801 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include "shard.h"
+#include "baidu/rpc/server.h"
+DECLARE_int32(write_batch_size);
+DECLARE_int32(write_batch_wait_us);
+DECLARE_string(wal_sync_policy);
+DECLARE_int32(wal_sync_interval_ms);
+DECLARE_int64(bloom_filter_keys);
+DECLARE_int64(hash_index_keys);
+DECLARE_string(reclaim_policy);
+DECLARE_bool(background_gc);
+DECLARE_int32(ttl_check_interval_ms);
+DECLARE_int32(ttl_expire_batch);
+DECLARE_int32(shard_num);
+DECLARE_int64(memory_limit_mb);
+DECLARE_string(write_mode);
+DECLARE_int32(write_queue_size);
+DECLARE_int32(write_queue_full_wait_us);
+DECLARE_int32(writer_spin_us);
+DECLARE_int32(value_log_threshold);
+DECLARE_int32(value_log_segment_mb);
+DECLARE_int32(value_log_gc_interval_s);
+DECLARE_double(value_log_gc_ratio);
+
+namespace kvservice {
+
+// lookups of a key whose value compaction moved meanwhile, each retry
+// sees the move applied
+static const int MOVED_RETRIES = 3;
+
+// Copy buf into one block of its own size. A value moved in from an rpc
+// attachment keeps the whole socket blocks it was read into, and small
+// appends share blocks, neither of which memory_bytes can see.
+static void own_block(base::IOBuf* buf) {
+    size_t n = buf->size();
+    if (n == 0) {
+        return;
+    }
+    char* data = static_cast<char*>(malloc(n));
+    buf->copy_to(data, n);
+    buf->clear();
+    buf->append_user_data(data, n, free);
+}
+
+int KVShard::stop() {
+    {
+        // compaction waits for the writer, it goes first
+        std::lock_guard<std::mutex> lk(_compact_mutex);
+        _compact_stop.store(true);
+    }
+    _compact_cond.notify_one();
+    if (_compact_thread.joinable()) {
+        _compact_thread.join();
+    }
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _stop.store(true);
+    }
+    _cond.notify_one();
+    if (_write_thread.joinable()) {
+        _write_thread.join();
+    }
+    hide_metrics();
+    if (_snapshot_thread.joinable()) {
+        _snapshot_thread.join();
+    }
+    if (_skip_list) {
+        if (_started && !_dump_file.empty()) {
+            // the values the dump refers to must be on disk before it
+            uint64_t dump = _value_log ? _value_log->begin_dump() : 0;
+            bool ok = (!_value_log || _value_log->sync() == 0)
+                && _skip_list->dump(_dump_file, _sequence);
+            if (_value_log) {
+                _value_log->end_dump(dump, ok);
+            }
+            // the dump holds everything the wal has, drop the log once it is safe
+            if (ok && _wal && _wal->open(_sequence + 1) == 0) {
+                _wal->purge(_sequence);
+            }
+        }
+        delete _skip_list;
+        _skip_list = nullptr;
+    }
+    _started = false;
+    _wal.reset();
+    _value_log.reset();
+    return 0;
+}
+
+int KVShard::start() {
+    _started = false;
+    _stop.store(false);
+    _compact_stop.store(false);
+    _sequence = 0;
+    _wal_broken = false;
+    if (FLAGS_write_queue_size <= 0) {
+        LOG(ERROR) << "invalid write_queue_size:" << FLAGS_write_queue_size;
+        return -1;
+    }
+    _queue.reset(new WriteRing<WriteTask*>(FLAGS_write_queue_size));
+    reclaim::Policy reclaim_policy;
+    if (reclaim::parse_policy(FLAGS_reclaim_policy, &reclaim_policy) != 0) {
+        LOG(ERROR) << "unknown reclaim_policy:" << FLAGS_reclaim_policy;
+        return -1;
+    }
+    if (FLAGS_write_mode == "direct") {
+        _direct = true;
+    } else if (FLAGS_write_mode == "queue") {
+        _direct = false;
+    } else {
+        LOG(ERROR) << "unknown write_mode:" << FLAGS_write_mode;
+        return -1;
+    }
+    // the wal and the writer side features need a single writer
+    if (_direct && (reclaim_policy != reclaim::EPOCH || !_wal_file.empty()
+                || !_value_log_file.empty() || FLAGS_bloom_filter_keys > 0
+                || FLAGS_hash_index_keys > 0 || FLAGS_memory_limit_mb > 0)) {
+        LOG(ERROR) << "write_mode direct needs the epoch reclaim_policy, an empty wal_path, "
+                   << "an empty value_log_path, no bloom_filter_keys, no hash_index_keys "
+                   << "and no memory_limit_mb";
+        return -1;
+    }
+    if (!_value_log_file.empty()) {
+        if (FLAGS_value_log_threshold < 0 || FLAGS_value_log_segment_mb <= 0
+                || !(FLAGS_value_log_gc_ratio > 0 && FLAGS_value_log_gc_ratio <= 1)) {
+            LOG(ERROR) << "invalid value_log_threshold:" << FLAGS_value_log_threshold
+                       << ", value_log_segment_mb:" << FLAGS_value_log_segment_mb
+                       << " or value_log_gc_ratio:" << FLAGS_value_log_gc_ratio;
+            return -1;
+        }
+        // a dump may refer to segments compaction is done with
+        _value_log.reset(new ValueLog(_value_log_file, FLAGS_value_log_threshold,
+                    static_cast<int64_t>(FLAGS_value_log_segment_mb) << 20, !_dump_file.empty()));
+        if (_value_log->open() != 0) {
+            LOG(ERROR) << "Fail to open value log " << _value_log_file;
+            return -1;
+        }
+    }
+    _skip_list = new KVSkipList(reclaim_policy);
+    if (_direct) {
+        // starts the reclaimer thread as well
+        _skip_list->enable_concurrent_writes();
+    } else if (FLAGS_background_gc) {
+        _skip_list->start_background_gc();
+    }
+    if (FLAGS_bloom_filter_keys > 0) {
+        _skip_list->enable_bloom_filter(FLAGS_bloom_filter_keys);
+    }
+    if (FLAGS_hash_index_keys > 0) {
+        _skip_list->enable_hash_index(FLAGS_hash_index_keys);
+    }
+    if (FLAGS_memory_limit_mb > 0) {
+        // the budget is shared evenly, keys are spread evenly over shards
+        _skip_list->set_memory_limit((FLAGS_memory_limit_mb << 20) / std::max(FLAGS_shard_num, 1));
+    }
+    _own_values = FLAGS_memory_limit_mb > 0;
+    if (_value_log) {
+        _skip_list->set_snapshot_flags(ValueLog::SNAPSHOT_FLAG);
+    }
+    if (!_dump_file.empty() && !_skip_list->load(_dump_file, &_sequence)) {
+        LOG(ERROR) << "Fail to load dump " << _dump_file
+                   << (_value_log ? " with the value log" : " without the value log");
+        return -1;
+    }
+
+    if (!_wal_file.empty()) {
+        if (Wal::parse_sync_policy(FLAGS_wal_sync_policy, &_sync_policy) != 0) {
+            LOG(ERROR) << "unknown wal_sync_policy:" << FLAGS_wal_sync_policy;
+            return -1;
+        }
+        _wal.reset(new Wal(_wal_file));
+        // writes logged after the dump was taken
+        bool io_error = false;
+        // _sequence stays at the last record applied, the records after
+        // one that failed are not applied either
+        auto replay = [this, &io_error](const WalRecord& record) {
+            if (io_error) {
+                return;
+            }
+            if (record.type == WalRecord::PUT) {
+                // keys expired meanwhile are unlinked by the first expire
+                insert(record.key, record.value, record.expire_ms, &io_error);
+            } else {
+                base::IOBuf value;
+                _skip_list->remove(record.key, value);
+            }
+            if (!io_error) {
+                _sequence = record.sequence;
+            }
+        };
+        uint64_t last_seq = _sequence;
+        if (_wal->replay(_sequence, replay, &last_seq) != 0 || io_error
+                || _wal->open(_sequence + 1) != 0) {
+            LOG(ERROR) << "Fail to recover wal " << _wal_file;
+            _wal.reset();
+            return -1;
+        }
+        LOG(INFO) << "shard " << _id << " recovered to wal sequence " << _sequence;
+    }
+
+    if (_value_log) {
+        // what the dump and the replay left in the skiplist is live, the
+        // writer keeps the count from now on
+        _value_log->reset_live();
+        _skip_list->for_each([this](const skiplist::ByteKey&, const base::IOBuf& stored) {
+            _value_log->add_live(stored);
+        });
+        _skip_list->set_drop_handler([this](const base::IOBuf& stored) {
+            _value_log->drop(stored);
+        });
+    }
+
+    expose_metrics();
+    if (!_direct) {
+        _write_thread = std::thread([this](){ this->write_loop(); });
+        if (_value_log && FLAGS_value_log_gc_interval_s > 0) {
+            _compact_thread = std::thread([this](){ this->compact_loop(); });
+        }
+    }
+    _started = true;
+    return 0;
+}
+
+int KVShard::get(const skiplist::ByteKey& key, base::IOBuf* value) {
+    if (!_value_log) {
+        return _skip_list->search(key, *value) ? 1 : 0;
+    }
+    base::IOBuf stored;
+    for (int i = 0; i < MOVED_RETRIES; ++i) {
+        if (!_skip_list->search(key, stored)) {
+            return 0;
+        }
+        int ret = _value_log->load(stored, value);
+        if (ret != 1) {
+            return ret == 0 ? 1 : -1;
+        }
+    }
+    LOG(ERROR) << "shard " << _id << " keeps missing the value log segment of a key";
+    return -1;
+}
+
+int KVShard::resolve(const skiplist::ByteKey& key, base::IOBuf* value) {
+    if (!_value_log) {
+        return 1;
+    }
+    base::IOBuf stored;
+    stored.swap(*value);
+    int ret = _value_log->load(stored, value);
+    if (ret == 1) {
+        return get(key, value);
+    }
+    return ret == 0 ? 1 : -1;
+}
+
+bool KVShard::insert(const skiplist::ByteKey& key, const base::IOBuf& value, uint64_t expire_ms,
+        bool* io_error) {
+    if (!_value_log && !_own_values) {
+        return _skip_list->insert(key, value, expire_ms);
+    }
+    base::IOBuf stored;
+    if (!_value_log) {
+        stored = value;
+    } else if (!_value_log->store(key, value, expire_ms, &stored)) {
+        *io_error = true;
+        return false;
+    }
+    if (_own_values) {
+        own_block(&stored);
+    }
+    return _skip_list->insert(key, stored, expire_ms);
+}
+
+void KVShard::relocate(const ValueMove& move) {
+    base::IOBuf stored;
+    ValueHandle handle;
+    // updated, removed or expired since compaction copied it. A move is
+    // no access, the key keeps its eviction mark and its expiry.
+    if (!_skip_list->peek(move.key, stored) || !ValueLog::decode(stored, &handle)
+            || !(handle == move.from)) {
+        return;
+    }
+    ValueLog::encode(move.to, &stored);
+    if (_own_values) {
+        own_block(&stored);
+    }
+    _value_log->add_live(stored);
+    _skip_list->replace_value(move.key, stored);
+}
+
+bool KVShard::submit_moves(std::vector<ValueMove>* moves) {
+    WriteTask task(WriteTask::RELOCATE);
+    task.moves.swap(*moves);
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool done = false;
+    while (true) {
+        done = false;
+        task.rejected = false;
+        task.done = create_closure([&mutex, &cond, &done]() {
+            std::lock_guard<std::mutex> lk(mutex);
+            done = true;
+            cond.notify_one();
+        });
+        submit(&task);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&done]{return done;});
+        }
+        if (!task.rejected) {
+            return !task.io_error;
+        }
+        // client writes fill the queue, compaction gives way to them
+        if (_compact_stop.load()) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void KVShard::compact_loop() {
+    auto is_live = [this](const skiplist::ByteKey& key, const ValueHandle& handle) {
+        base::IOBuf stored;
+        ValueHandle current;
+        return _skip_list->peek(key, stored) && ValueLog::decode(stored, &current)
+            && current == handle;
+    };
+    auto relocate = [this](std::vector<ValueMove>* moves) {
+        return submit_moves(moves);
+    };
+    std::unique_lock<std::mutex> lock(_compact_mutex);
+    while (!_compact_cond.wait_for(lock, std::chrono::seconds(FLAGS_value_log_gc_interval_s),
+                [this]{return _compact_stop.load();})) {
+        lock.unlock();
+        // every segment due, one at a time
+        int ret = 0;
+        while (!_compact_stop.load()
+                && (ret = _value_log->compact(FLAGS_value_log_gc_ratio, is_live, relocate)) > 0) {
+            _value_log_compacted << 1;
+        }
+        if (ret < 0) {
+            LOG(WARNING) << "shard " << _id << " fails to compact its value log";
+        }
+        lock.lock();
+    }
+}
+
+void KVShard::expose_metrics() {
+    std::string prefix = "kv_shard_" + std::to_string(_id);
+    _batch_size.expose(prefix + "_write_batch_size");
+    _max_batch_size.expose(prefix + "_write_batch_size_max");
+    _batch_count.expose(prefix + "_write_batch_count");
+    _wal_sync_latency.expose(prefix + "_wal_sync");
+    _snapshot_latency.expose(prefix + "_snapshot");
+    _queue_depth.expose(prefix + "_queue_depth");
+    _queue_wait_latency.expose(prefix + "_queue_wait");
+    _wal_write_latency.expose(prefix + "_wal_write");
+    _apply_latency.expose(prefix + "_apply");
+    _rejected_count.expose(prefix + "_write_rejected");
+    _gc_backlog.expose(prefix + "_gc_backlog");
+    _gc_pinned.expose(prefix + "_gc_pinned");
+    _gc_reader_slots.expose(prefix + "_gc_reader_slots");
+    _list_size.expose(prefix + "_size");
+    _list_level.expose(prefix + "_level");
+    _key_bytes.expose(prefix + "_key_bytes");
+    _value_bytes.expose(prefix + "_value_bytes");
+    _ttl_keys.expose(prefix + "_ttl_keys");
+    _expired_count.expose(prefix + "_expired");
+    _memory_bytes.expose(prefix + "_memory_bytes");
+    _evicted.expose(prefix + "_evicted");
+    _value_log_bytes.expose(prefix + "_value_log_bytes");
+    _value_log_live_bytes.expose(prefix + "_value_log_live_bytes");
+    _value_log_compacted.expose(prefix + "_value_log_compacted");
+}
+
+// the passive ones read the skiplist, hidden before it goes away
+void KVShard::hide_metrics() {
+    _queue_depth.hide();
+    _gc_backlog.hide();
+    _gc_pinned.hide();
+    _gc_reader_slots.hide();
+    _list_size.hide();
+    _list_level.hide();
+    _key_bytes.hide();
+    _value_bytes.hide();
+    _ttl_keys.hide();
+    _memory_bytes.hide();
+    _evicted.hide();
+    _value_log_bytes.hide();
+    _value_log_live_bytes.hide();
+}
+
+bool KVShard::submit(WriteTask* task) {
+    if (_direct) {
+        auto start = std::chrono::steady_clock::now();
+        apply(task);
+        _apply_latency << std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        task->done->Run();
+        return true;
+    }
+    task->submit_time = std::chrono::steady_clock::now();
+    if (!_queue->push(task)) {
+        // overload is rejected instead of queued without bound, unless the
+        // caller accepts to wait a little for room
+        auto deadline = task->submit_time
+                + std::chrono::microseconds(FLAGS_write_queue_full_wait_us);
+        bool pushed = false;
+        while (!pushed && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+            pushed = _queue->push(task);
+        }
+        if (!pushed) {
+            _rejected_count << 1;
+            task->rejected = true;
+            task->done->Run();
+            return false;
+        }
+    }
+    wake();
+    return true;
+}
+
+void KVShard::wake() {
+    // pairs with the fence in park: either the writer sees the write when
+    // it checks the queue, or this sees _parked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_parked.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _cond.notify_one();
+    }
+}
+
+bool KVShard::spin() {
+    if (FLAGS_writer_spin_us <= 0) {
+        return !_queue->empty();
+    }
+    auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::microseconds(FLAGS_writer_spin_us);
+    while (true) {
+        // the clock is read once in a while only
+        for (int i = 0; i < 64; ++i) {
+            if (!_queue->empty()) {
+                return true;
+            }
+            cpu_relax();
+        }
+        if (_stop.load() || std::chrono::steady_clock::now() >= deadline) {
+            return !_queue->empty();
+        }
+    }
+}
+
+bool KVShard::park(bool timed, std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto ready = [this]{return !_queue->empty() || _stop.load();};
+    bool woken = true;
+    if (!timed) {
+        _cond.wait(lock, ready);
+    } else {
+        woken = _cond.wait_until(lock, deadline, ready);
+    }
+    _parked.store(false, std::memory_order_relaxed);
+    return woken;
+}
+
+int KVShard::snapshot() {
+    // the skiplist freezes its content for a single writer only
+    if (_dump_file.empty() || _direct) {
+        return -1;
+    }
+    bool running = false;
+    if (!_snapshot_running.compare_exchange_strong(running, true)) {
+        return -1;
+    }
+    // go through the write queue, the image is taken between two writes
+    WriteTask* task = new WriteTask(WriteTask::SNAPSHOT);
+    task->done = create_closure([task]() {
+        delete task;
+    });
+    if (!submit(task)) {
+        _snapshot_running.store(false);
+        return -1;
+    }
+    return 0;
+}
+
+bool KVShard::start_snapshot(uint64_t sequence) {
+    if (_snapshot_thread.joinable()) {
+        _snapshot_thread.join();
+    }
+    if (!_skip_list->begin_snapshot()) {
+        _snapshot_running.store(false);
+        return false;
+    }
+    _rotate_wal = (_wal != nullptr);
+    // taken with the image, so compaction keeps what it refers to
+    uint64_t dump = _value_log ? _value_log->begin_dump() : 0;
+    _snapshot_thread = std::thread([this, sequence, dump](){ this->run_snapshot(sequence, dump); });
+    return true;
+}
+
+void KVShard::run_snapshot(uint64_t sequence, uint64_t dump) {
+    auto start = std::chrono::steady_clock::now();
+    // every value of the image is written by now, sealed segments are
+    // synced already
+    bool ok = (!_value_log || _value_log->sync() == 0)
+        && _skip_list->dump_snapshot(_dump_file, sequence);
+    if (_value_log) {
+        _value_log->end_dump(dump, ok);
+    }
+    if (ok && _wal) {
+        _wal->purge(sequence);
+    }
+    int64_t cost_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    _snapshot_latency << cost_ms;
+    LOG(INFO) << "shard " << _id << " snapshot at wal sequence " << sequence
+              << (ok ? " done" : " failed") << ", cost " << cost_ms << "ms";
+    _snapshot_running.store(false);
+}
+
+int64_t KVShard::get_queue_depth(void* shard) {
+    return static_cast<KVShard*>(shard)->_queue->size();
+}
+
+int64_t KVShard::get_gc_backlog(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->gc_backlog();
+}
+
+int64_t KVShard::get_gc_pinned(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->gc_pinned();
+}
+
+int64_t KVShard::get_gc_reader_slots(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->gc_reader_slots();
+}
+
+int64_t KVShard::get_list_size(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->size();
+}
+
+int64_t KVShard::get_list_level(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->level();
+}
+
+int64_t KVShard::get_key_bytes(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->key_bytes();
+}
+
+int64_t KVShard::get_value_bytes(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->value_bytes();
+}
+
+int64_t KVShard::get_ttl_keys(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->ttl_keys();
+}
+
+int64_t KVShard::get_memory_bytes(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->memory_bytes();
+}
+
+int64_t KVShard::get_evicted(void* shard) {
+    return static_cast<KVShard*>(shard)->_skip_list->evicted();
+}
+
+int64_t KVShard::get_value_log_bytes(void* shard) {
+    ValueLog* value_log = static_cast<KVShard*>(shard)->_value_log.get();
+    return value_log ? value_log->bytes() : 0;
+}
+
+int64_t KVShard::get_value_log_live_bytes(void* shard) {
+    ValueLog* value_log = static_cast<KVShard*>(shard)->_value_log.get();
+    return value_log ? value_log->live_bytes() : 0;
+}
+
+size_t KVShard::drain(std::vector<WriteTask*>& batch, size_t max) {
+    size_t n = 0;
+    WriteTask* task;
+    while (batch.size() < max && _queue->pop(&task)) {
+        _queue_wait_latency << std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - task->submit_time).count();
+        batch.push_back(task);
+        ++n;
+    }
+    return n;
+}
+
+void KVShard::apply(WriteTask* task) {
+    if (task->type == WriteTask::PUT) {
+        task->result = insert(task->key, task->value, task->expire_ms, &task->io_error);
+    } else if (task->type == WriteTask::REMOVE) {
+        base::IOBuf value;
+        task->result = _skip_list->remove(task->key, value);
+    } else if (task->type == WriteTask::MULTI_PUT) {
+        task->result = true;
+        for (auto& entry : task->entries) {
+            task->result = insert(entry.first, entry.second, 0, &task->io_error) && task->result;
+        }
+    } else if (task->type == WriteTask::RELOCATE) {
+        task->result = true;
+        for (auto& move : task->moves) {
+            relocate(move);
+        }
+    } else {
+        task->result = start_snapshot(task->sequence);
+    }
+}
+
+// snapshots and relocations go through the queue but not the wal
+static bool logged(const WriteTask* task) {
+    return task->type != WriteTask::SNAPSHOT && task->type != WriteTask::RELOCATE;
+}
+
+void KVShard::commit(std::vector<WriteTask*>& batch) {
+    auto start = std::chrono::steady_clock::now();
+    if (_wal && _wal_broken) {
+        for (auto task : batch) {
+            task->io_error = logged(task);
+            if (task->type == WriteTask::SNAPSHOT) {
+                task->sequence = _sequence;
+            }
+        }
+    } else if (_wal) {
+        for (auto task : batch) {
+            if (task->type == WriteTask::SNAPSHOT) {
+                // holds everything logged before it
+                task->sequence = _sequence;
+                continue;
+            }
+            if (task->type == WriteTask::RELOCATE) {
+                // the dumps taken before it and the wal records after them
+                // still find the original values
+                continue;
+            }
+            if (task->type == WriteTask::MULTI_PUT) {
+                for (auto& entry : task->entries) {
+                    _wal->append(++_sequence, WalRecord::PUT, entry.first, &entry.second);
+                }
+                task->sequence = _sequence;
+                continue;
+            }
+            task->sequence = ++_sequence;
+            if (task->type == WriteTask::PUT) {
+                _wal->append(task->sequence, WalRecord::PUT, task->key, &task->value,
+                        task->expire_ms);
+            } else {
+                _wal->append(task->sequence, WalRecord::REMOVE, task->key, nullptr);
+            }
+        }
+        // one write for the whole batch, nothing is applied unless logged
+        if (_wal->flush() != 0) {
+            for (auto task : batch) {
+                task->io_error = logged(task);
+            }
+        }
+        _wal_write_latency << std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+    // with an fsync to wait for, the batch is applied by sync_pending once
+    // it is durable
+    if (!_wal || _sync_policy == Wal::SYNC_NONE) {
+        apply_all(batch);
+    }
+}
+
+void KVShard::apply_all(std::vector<WriteTask*>& tasks) {
+    auto start = std::chrono::steady_clock::now();
+    for (auto task : tasks) {
+        if (!task->io_error) {
+            apply(task);
+        }
+    }
+    _apply_latency << std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+void KVShard::sync_pending() {
+    auto start = std::chrono::steady_clock::now();
+    // a failed fsync may have dropped the dirty pages of earlier records
+    // as well, nothing logged is trusted any more and the shard takes no
+    // more writes. The failed writes were never applied.
+    if (!_wal_broken && _wal->sync() != 0) {
+        LOG(ERROR) << "shard " << _id << " refuses writes after a failed wal sync";
+        _wal_broken = true;
+        for (auto task : _pending_sync) {
+            task->io_error = logged(task);
+        }
+    }
+    auto now = std::chrono::steady_clock::now();
+    _wal_sync_latency << std::chrono::duration_cast<std::chrono::microseconds>(
+            now - start).count();
+    _next_sync = now + std::chrono::milliseconds(FLAGS_wal_sync_interval_ms);
+    apply_all(_pending_sync);
+    respond(_pending_sync);
+}
+
+// Expiring is not logged, replaying the puts brings back the same expire
+// times. The writer handles at most ttl_expire_batch due keys between two
+// batches of writes, a backlog is taken up again right after the next
+// batch instead of waiting for the next check.
+void KVShard::expire() {
+    auto now = std::chrono::steady_clock::now();
+    if (now < _next_expire || _skip_list->ttl_keys() == 0) {
+        return;
+    }
+    _expired_count << _skip_list->expire(std::max(FLAGS_ttl_expire_batch, 1));
+    _next_expire = _skip_list->expire_backlog() > 0 ? now
+        : now + std::chrono::milliseconds(FLAGS_ttl_check_interval_ms);
+}
+
+void KVShard::respond(std::vector<WriteTask*>& tasks) {
+    for (auto task : tasks) {
+        task->done->Run();
+    }
+    tasks.clear();
+}
+
+void KVShard::write_loop() {
+    const size_t max_batch = std::max(FLAGS_write_batch_size, 1);
+    std::vector<WriteTask*> batch;
+    batch.reserve(max_batch);
+    _next_sync = std::chrono::steady_clock::now();
+    _next_expire = _next_sync;
+    while (true) {
+        bool stop = false;
+        {
+            // wake up for the interval fsync and the expire check even
+            // without new writes
+            bool timed = !_pending_sync.empty();
+            auto deadline = _next_sync;
+            if (_skip_list->ttl_keys() > 0) {
+                deadline = timed ? std::min(deadline, _next_expire) : _next_expire;
+                timed = true;
+            }
+            // a busy writer never sleeps, producers then skip the wakeup
+            if (!spin()) {
+                park(timed, deadline);
+            }
+            stop = _stop.load();
+        }
+        // group commit: take everything queued, then linger for stragglers
+        // until the batch is full or write_batch_wait_us is over
+        drain(batch, max_batch);
+        if (!stop && FLAGS_write_batch_wait_us > 0 && batch.size() < max_batch) {
+            auto deadline = std::chrono::steady_clock::now()
+                    + std::chrono::microseconds(FLAGS_write_batch_wait_us);
+            while (batch.size() < max_batch) {
+                if (!park(true, deadline)) {
+                    break;
+                }
+                if (drain(batch, max_batch) == 0) {
+                    break;
+                }
+            }
+        }
+
+        if (!batch.empty()) {
+            _batch_size << batch.size();
+            _max_batch_size << batch.size();
+            _batch_count << 1;
+            commit(batch);
+        }
+
+        // a write is applied and acknowledged only once its wal record is
+        // as durable as the sync policy asks for
+        if (!_wal || _sync_policy == Wal::SYNC_NONE) {
+            respond(batch);
+        } else {
+            _pending_sync.insert(_pending_sync.end(), batch.begin(), batch.end());
+            batch.clear();
+            if (!_pending_sync.empty()
+                    && (_sync_policy == Wal::SYNC_ALWAYS || stop
+                        || std::chrono::steady_clock::now() >= _next_sync)) {
+                sync_pending();
+            }
+        }
+        if (_rotate_wal) {
+            // records logged after the snapshot point are synced already,
+            // the segment is closed after them and the next one starts clean
+            _rotate_wal = false;
+            if (_wal->open(_sequence + 1) != 0) {
+                LOG(ERROR) << "Fail to rotate wal of shard " << _id;
+            }
+        }
+
+        if (!stop) {
+            expire();
+        }
+
+        // keep draining until every queued write got its response, the
+        // size includes writes claimed but not published yet
+        if (stop && _queue->size() == 0) {
+            break;
+        }
+    }
+}
+}
@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <base/crc32c.h>
+#include <base/logging.h>
+#include "value_log.h"
+#include "wal.h"
+
+namespace kvservice {
+
+// crc32c + length
+static const size_t HEADER_SIZE = 8;
+// expire + key size
+static const size_t FIXED_BODY_SIZE = 12;
+// records compaction writes at once, and moves handed to the writer at once
+static const size_t COMPACT_WRITE_SIZE = 4 << 20;
+static const size_t MOVE_BATCH = 1024;
+
+template <typename T>
+static T get_fixed(const char* src) {
+    T v;
+    memcpy(&v, src, sizeof(v));
+    return v;
+}
+
+// return bytes read, less than len only at end of file, -1 on error
+static ssize_t pread_full(int fd, char* data, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = ::pread(fd, data + done, len - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+ValueLog::Segment::~Segment() {
+    ::close(fd);
+}
+
+int ValueLog::open() {
+    std::vector<std::pair<uint64_t, std::string>> files;
+    if (list_numbered_files(_path, &files) != 0) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lk(_mutex);
+    for (auto& file : files) {
+        int fd = ::open(file.second.c_str(), O_RDONLY);
+        if (fd < 0) {
+            PLOG(ERROR) << "Fail to open value log segment " << file.second;
+            return -1;
+        }
+        uint32_t id = static_cast<uint32_t>(file.first);
+        std::shared_ptr<Segment> segment(new Segment(id, file.second, fd));
+        segment->bytes.store(lseek(fd, 0, SEEK_END));
+        _segments[id] = segment;
+        _next_id.store(id + 1);
+    }
+    _active = create(_next_id++);
+    if (!_active) {
+        return -1;
+    }
+    _segments[_active->id] = _active;
+    return 0;
+}
+
+std::shared_ptr<ValueLog::Segment> ValueLog::create(uint32_t id) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%010u", id);
+    std::string file = _path + suffix;
+    int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open value log segment " << file;
+        return nullptr;
+    }
+    // a dump may point into the segment once the wal is purged
+    if (lseek(fd, 0, SEEK_END) == 0 && skiplist::snapshot::sync_dir(file) != 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    std::shared_ptr<Segment> segment(new Segment(id, file, fd));
+    segment->bytes.store(lseek(fd, 0, SEEK_END));
+    return segment;
+}
+
+std::shared_ptr<ValueLog::Segment> ValueLog::find(uint32_t id) const {
+    std::lock_guard<std::mutex> lk(_mutex);
+    auto it = _segments.find(id);
+    return it == _segments.end() ? nullptr : it->second;
+}
+
+void ValueLog::encode(const ValueHandle& handle, base::IOBuf* stored) {
+    char buf[HANDLE_SIZE];
+    buf[0] = HANDLE;
+    memcpy(buf + 1, &handle.segment, sizeof(handle.segment));
+    memcpy(buf + 5, &handle.offset, sizeof(handle.offset));
+    memcpy(buf + 13, &handle.size, sizeof(handle.size));
+    stored->clear();
+    stored->append(buf, HANDLE_SIZE);
+}
+
+bool ValueLog::decode(const base::IOBuf& stored, ValueHandle* handle) {
+    char buf[HANDLE_SIZE];
+    if (stored.size() != HANDLE_SIZE || stored.copy_to(buf, HANDLE_SIZE) != HANDLE_SIZE
+            || buf[0] != HANDLE) {
+        return false;
+    }
+    handle->segment = get_fixed<uint32_t>(buf + 1);
+    handle->offset = get_fixed<uint64_t>(buf + 5);
+    handle->size = get_fixed<uint32_t>(buf + 13);
+    return true;
+}
+
+size_t ValueLog::encode_record(const skiplist::ByteKey& key, const base::IOBuf& value,
+        uint64_t expire_ms, std::string* buf) {
+    uint32_t key_size = key.size();
+    uint32_t length = FIXED_BODY_SIZE + key_size + value.size();
+    size_t start = buf->size();
+    buf->resize(start + HEADER_SIZE + length);
+    char* p = &(*buf)[start];
+    memcpy(p + 4, &length, sizeof(length));
+    memcpy(p + HEADER_SIZE, &expire_ms, sizeof(expire_ms));
+    memcpy(p + HEADER_SIZE + 8, &key_size, sizeof(key_size));
+    memcpy(p + HEADER_SIZE + FIXED_BODY_SIZE, key.bytes().data(), key_size);
+    size_t value_offset = HEADER_SIZE + FIXED_BODY_SIZE + key_size;
+    value.copy_to(p + value_offset, value.size());
+    uint32_t crc = base::crc32c::Value(p + HEADER_SIZE, length);
+    memcpy(p, &crc, sizeof(crc));
+    return value_offset;
+}
+
+bool ValueLog::store(const skiplist::ByteKey& key, const base::IOBuf& value, uint64_t expire_ms,
+        base::IOBuf* stored) {
+    if (value.size() < _threshold) {
+        stored->clear();
+        stored->push_back(INLINE);
+        stored->append(value);
+        return true;
+    }
+    _buf.clear();
+    size_t value_offset = encode_record(key, value, expire_ms, &_buf);
+    Segment* segment = _active.get();
+    int64_t offset = segment->bytes.load(std::memory_order_relaxed);
+    if (write_full(segment->fd, _buf.data(), _buf.size()) != 0) {
+        PLOG(ERROR) << "Fail to write value log " << segment->file;
+        // cut the partial write, later records must follow a clean record
+        if (ftruncate(segment->fd, offset) != 0) {
+            PLOG(ERROR) << "Fail to truncate value log " << segment->file;
+        }
+        return false;
+    }
+    int64_t end = offset + _buf.size();
+    segment->bytes.store(end, std::memory_order_relaxed);
+    ValueHandle handle;
+    handle.segment = segment->id;
+    handle.offset = offset + value_offset;
+    handle.size = value.size();
+    segment->live.fetch_add(handle.size, std::memory_order_relaxed);
+    encode(handle, stored);
+    // the value is written anyway, the next ones go on in this segment
+    if (end >= _segment_bytes && roll() != 0) {
+        LOG(ERROR) << "Fail to seal value log segment " << segment->file;
+    }
+    return true;
+}
+
+int ValueLog::load(const base::IOBuf& stored, base::IOBuf* value) {
+    ValueHandle handle;
+    if (!decode(stored, &handle)) {
+        // shares the blocks, nothing is copied
+        *value = stored;
+        value->pop_front(1);
+        return 0;
+    }
+    std::shared_ptr<Segment> segment = find(handle.segment);
+    if (!segment) {
+        return 1;
+    }
+    value->clear();
+    if (handle.size == 0) {
+        return 0;
+    }
+    char* data = static_cast<char*>(malloc(handle.size));
+    if (pread_full(segment->fd, data, handle.size, handle.offset)
+            != static_cast<ssize_t>(handle.size)) {
+        PLOG(ERROR) << "Fail to read " << handle.size << " bytes at offset " << handle.offset
+                    << " of value log " << segment->file;
+        free(data);
+        return -1;
+    }
+    value->append_user_data(data, handle.size, free);
+    return 0;
+}
+
+void ValueLog::add_live(const base::IOBuf& stored) {
+    ValueHandle handle;
+    if (!decode(stored, &handle)) {
+        return;
+    }
+    std::shared_ptr<Segment> segment = find(handle.segment);
+    if (segment) {
+        segment->live.fetch_add(handle.size, std::memory_order_relaxed);
+    }
+}
+
+void ValueLog::drop(const base::IOBuf& stored) {
+    ValueHandle handle;
+    if (!decode(stored, &handle)) {
+        return;
+    }
+    // gone already if it was compacted away
+    std::shared_ptr<Segment> segment = find(handle.segment);
+    if (segment) {
+        segment->live.fetch_sub(handle.size, std::memory_order_relaxed);
+    }
+}
+
+void ValueLog::reset_live() {
+    std::lock_guard<std::mutex> lk(_mutex);
+    for (auto& entry : _segments) {
+        entry.second->live.store(0, std::memory_order_relaxed);
+    }
+}
+
+int ValueLog::roll() {
+    if (fdatasync(_active->fd) != 0) {
+        PLOG(ERROR) << "Fail to sync value log " << _active->file;
+        return -1;
+    }
+    std::shared_ptr<Segment> next = create(_next_id++);
+    if (!next) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lk(_mutex);
+    _segments[next->id] = next;
+    _active = next;
+    return 0;
+}
+
+int ValueLog::sync() {
+    std::shared_ptr<Segment> active;
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        active = _active;
+    }
+    if (!active || fdatasync(active->fd) != 0) {
+        PLOG(ERROR) << "Fail to sync value log " << _path;
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t ValueLog::begin_dump() {
+    return ++_dumps;
+}
+
+void ValueLog::end_dump(uint64_t dump, bool ok) {
+    if (!ok) {
+        return;
+    }
+    std::lock_guard<std::mutex> lk(_mutex);
+    auto it = _retired.begin();
+    while (it != _retired.end()) {
+        if (it->second >= dump) {
+            ++it;
+            continue;
+        }
+        if (unlink(it->first->file.c_str()) != 0) {
+            PLOG(ERROR) << "Fail to remove value log segment " << it->first->file;
+        }
+        it = _retired.erase(it);
+    }
+}
+
+void ValueLog::retire(const std::shared_ptr<Segment>& segment) {
+    std::lock_guard<std::mutex> lk(_mutex);
+    _segments.erase(segment->id);
+    _stalled.erase(segment->id);
+    if (_keep_until_dump) {
+        _retired.emplace_back(segment, _dumps.load());
+        return;
+    }
+    // readers holding it keep reading through their descriptor
+    if (unlink(segment->file.c_str()) != 0) {
+        PLOG(ERROR) << "Fail to remove value log segment " << segment->file;
+    }
+}
+
+int ValueLog::compact(double ratio,
+        const std::function<bool(const skiplist::ByteKey&, const ValueHandle&)>& is_live,
+        const std::function<bool(std::vector<ValueMove>*)>& relocate) {
+    std::shared_ptr<Segment> victim;
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        double most = ratio;
+        for (auto& entry : _segments) {
+            if (entry.second == _active) {
+                continue;
+            }
+            int64_t bytes = entry.second->bytes.load(std::memory_order_relaxed);
+            int64_t live = std::max<int64_t>(entry.second->live.load(std::memory_order_relaxed), 0);
+            // nothing changed since it was last left over, another
+            // compaction would leave it over again
+            auto stalled = _stalled.find(entry.first);
+            if (stalled != _stalled.end() && stalled->second == live) {
+                continue;
+            }
+            double dead = bytes > 0 ? 1.0 - static_cast<double>(live) / bytes : 1.0;
+            if (dead >= most) {
+                most = dead;
+                victim = entry.second;
+            }
+        }
+    }
+    if (!victim) {
+        return 0;
+    }
+    if (victim->live.load(std::memory_order_relaxed) <= 0) {
+        retire(victim);
+        return 1;
+    }
+
+    // copy the live records as they are, a torn or damaged one ends the
+    // scan and whatever is still referred to after it keeps the segment
+    std::shared_ptr<Segment> out;
+    // the new segment is nobody's until it is listed, drop it on failure
+    auto fail = [&out]() {
+        if (out && unlink(out->file.c_str()) != 0) {
+            PLOG(ERROR) << "Fail to remove value log segment " << out->file;
+        }
+        return -1;
+    };
+    std::vector<ValueMove> moves;
+    std::string record;
+    std::string buf;
+    int64_t end = victim->bytes.load(std::memory_order_relaxed);
+    int64_t offset = 0;
+    while (end - offset >= static_cast<int64_t>(HEADER_SIZE)) {
+        record.resize(HEADER_SIZE);
+        if (pread_full(victim->fd, &record[0], HEADER_SIZE, offset)
+                != static_cast<ssize_t>(HEADER_SIZE)) {
+            PLOG(ERROR) << "Fail to read value log " << victim->file;
+            return fail();
+        }
+        uint32_t length = get_fixed<uint32_t>(record.data() + 4);
+        if (length < FIXED_BODY_SIZE || end - offset - HEADER_SIZE < length) {
+            LOG(WARNING) << "Bad record in value log " << victim->file << " at offset " << offset;
+            break;
+        }
+        record.resize(HEADER_SIZE + length);
+        if (pread_full(victim->fd, &record[HEADER_SIZE], length, offset + HEADER_SIZE)
+                != static_cast<ssize_t>(length)) {
+            PLOG(ERROR) << "Fail to read value log " << victim->file;
+            return fail();
+        }
+        uint32_t key_size = get_fixed<uint32_t>(record.data() + HEADER_SIZE + 8);
+        if (base::crc32c::Value(record.data() + HEADER_SIZE, length)
+                    != get_fixed<uint32_t>(record.data())
+                || key_size > length - FIXED_BODY_SIZE) {
+            LOG(WARNING) << "Bad record in value log " << victim->file << " at offset " << offset;
+            break;
+        }
+        size_t value_offset = HEADER_SIZE + FIXED_BODY_SIZE + key_size;
+        ValueMove move;
+        move.key = skiplist::ByteKey(record.data() + HEADER_SIZE + FIXED_BODY_SIZE, key_size);
+        move.from.segment = victim->id;
+        move.from.offset = offset + value_offset;
+        move.from.size = length + HEADER_SIZE - value_offset;
+        if (is_live(move.key, move.from)) {
+            if (!out && !(out = create(_next_id++))) {
+                return -1;
+            }
+            move.to.segment = out->id;
+            move.to.offset = out->bytes.load(std::memory_order_relaxed) + buf.size() + value_offset;
+            move.to.size = move.from.size;
+            moves.push_back(std::move(move));
+            buf.append(record);
+        }
+        if (buf.size() >= COMPACT_WRITE_SIZE) {
+            if (write_full(out->fd, buf.data(), buf.size()) != 0) {
+                PLOG(ERROR) << "Fail to write value log " << out->file;
+                return fail();
+            }
+            out->bytes.fetch_add(buf.size(), std::memory_order_relaxed);
+            buf.clear();
+        }
+        offset += HEADER_SIZE + length;
+    }
+    if (out) {
+        if (!buf.empty() && write_full(out->fd, buf.data(), buf.size()) != 0) {
+            PLOG(ERROR) << "Fail to write value log " << out->file;
+            return fail();
+        }
+        out->bytes.fetch_add(buf.size(), std::memory_order_relaxed);
+        // synced before any key refers to it, like a sealed segment
+        if (fdatasync(out->fd) != 0) {
+            PLOG(ERROR) << "Fail to sync value log " << out->file;
+            return fail();
+        }
+        std::lock_guard<std::mutex> lk(_mutex);
+        _segments[out->id] = out;
+    }
+    for (size_t i = 0; i < moves.size(); i += MOVE_BATCH) {
+        std::vector<ValueMove> batch(moves.begin() + i,
+                moves.begin() + std::min(moves.size(), i + MOVE_BATCH));
+        if (!relocate(&batch)) {
+            return -1;
+        }
+    }
+    // Keys read as expired are not moved, the segment waits for them to
+    // be unlinked. Until its live bytes change, the next segments due are
+    // compacted first.
+    int64_t live = victim->live.load(std::memory_order_relaxed);
+    if (live > 0) {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _stalled[victim->id] = live;
+        return 0;
+    }
+    retire(victim);
+    return 1;
+}
+
+int64_t ValueLog::bytes() const {
+    std::lock_guard<std::mutex> lk(_mutex);
+    int64_t total = 0;
+    for (auto& entry : _segments) {
+        total += entry.second->bytes.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+int64_t ValueLog::live_bytes() const {
+    std::lock_guard<std::mutex> lk(_mutex);
+    int64_t total = 0;
+    for (auto& entry : _segments) {
+        total += entry.second->live.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+}
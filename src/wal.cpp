@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <base/crc32c.h>
+#include <base/logging.h>
+#include "wal.h"
+
+namespace kvservice {
+
+// crc32c + length
+static const size_t HEADER_SIZE = 8;
+// sequence + type + key size, or + int64 key in old records
+static const size_t FIXED_BODY_SIZE = 13;
+static const size_t INT_KEY_BODY_SIZE = 17;
+// set in the type of records with a key size
+static const uint8_t SIZED_KEY = 0x80;
+// set in the type of records with an expire time
+static const uint8_t HAS_EXPIRE = 0x40;
+
+static void put_fixed32(std::string* dst, uint32_t v) {
+    dst->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+static void put_fixed64(std::string* dst, uint64_t v) {
+    dst->append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename T>
+static T get_fixed(const char* src) {
+    T v;
+    memcpy(&v, src, sizeof(v));
+    return v;
+}
+
+int write_full(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// return bytes read, less than len only at end of file, -1 on error
+static ssize_t read_full(int fd, char* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = ::read(fd, data + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+int Wal::parse_sync_policy(const std::string& name, SyncPolicy* policy) {
+    if (name == "always") {
+        *policy = SYNC_ALWAYS;
+    } else if (name == "interval") {
+        *policy = SYNC_INTERVAL;
+    } else if (name == "none") {
+        *policy = SYNC_NONE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int list_numbered_files(const std::string& path,
+        std::vector<std::pair<uint64_t, std::string>>* files) {
+    std::string dir = ".";
+    std::string base = path;
+    size_t slash = path.rfind('/');
+    if (slash != std::string::npos) {
+        dir = slash == 0 ? "/" : path.substr(0, slash);
+        base = path.substr(slash + 1);
+    }
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) {
+        PLOG(ERROR) << "Fail to open dir " << dir;
+        return -1;
+    }
+    std::string prefix = base + ".";
+    struct dirent* ent;
+    while ((ent = readdir(d)) != nullptr) {
+        std::string name = ent->d_name;
+        if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) {
+            continue;
+        }
+        std::string suffix = name.substr(prefix.size());
+        if (suffix.find_first_not_of("0123456789") != std::string::npos) {
+            continue;
+        }
+        files->emplace_back(strtoull(suffix.c_str(), nullptr, 10), path + "." + suffix);
+    }
+    closedir(d);
+    std::sort(files->begin(), files->end());
+    return 0;
+}
+
+int Wal::replay(uint64_t from_seq,
+        const std::function<void(const WalRecord&)>& apply,
+        uint64_t* last_seq) {
+    std::vector<std::pair<uint64_t, std::string>> segments;
+    if (list_numbered_files(_path, &segments) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < segments.size(); ++i) {
+        bool last = (i + 1 == segments.size());
+        if (replay_segment(segments[i].second, last, from_seq, apply, last_seq) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int Wal::replay_segment(const std::string& file, bool last, uint64_t from_seq,
+        const std::function<void(const WalRecord&)>& apply,
+        uint64_t* last_seq) {
+    int fd = ::open(file.c_str(), O_RDWR);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open wal segment " << file;
+        return -1;
+    }
+    char header[HEADER_SIZE];
+    std::string body;
+    off_t offset = 0;
+    int ret = 0;
+    while (true) {
+        ssize_t n = read_full(fd, header, HEADER_SIZE);
+        if (n == 0) {
+            break;
+        }
+        bool torn = (n != static_cast<ssize_t>(HEADER_SIZE));
+        uint32_t length = 0;
+        if (!torn) {
+            length = get_fixed<uint32_t>(header + 4);
+            torn = length < FIXED_BODY_SIZE;
+        }
+        if (!torn) {
+            body.resize(length);
+            torn = read_full(fd, &body[0], length) != static_cast<ssize_t>(length)
+                || base::crc32c::Value(body.data(), length) != get_fixed<uint32_t>(header);
+        }
+        if (torn) {
+            // only the tail of the newest segment can be half written
+            if (!last) {
+                LOG(ERROR) << "Corrupted wal record in " << file << " at offset " << offset;
+                ret = -1;
+            } else {
+                LOG(WARNING) << "Drop torn wal tail of " << file << " at offset " << offset;
+                if (ftruncate(fd, offset) != 0) {
+                    PLOG(ERROR) << "Fail to truncate " << file;
+                    ret = -1;
+                }
+            }
+            break;
+        }
+
+        WalRecord record;
+        record.sequence = get_fixed<uint64_t>(body.data());
+        uint8_t type = static_cast<uint8_t>(body[8]);
+        record.type = type & ~(SIZED_KEY | HAS_EXPIRE);
+        size_t value_offset = INT_KEY_BODY_SIZE;
+        if (type & SIZED_KEY) {
+            uint32_t key_size = get_fixed<uint32_t>(body.data() + 9);
+            if (key_size > length - FIXED_BODY_SIZE) {
+                LOG(ERROR) << "Bad key size in wal record of " << file << " at offset " << offset;
+                ret = -1;
+                break;
+            }
+            value_offset = FIXED_BODY_SIZE + key_size;
+            record.key = skiplist::ByteKey(body.data() + FIXED_BODY_SIZE, key_size);
+            if (type & HAS_EXPIRE) {
+                if (length - value_offset < sizeof(uint64_t)) {
+                    LOG(ERROR) << "Short wal record in " << file << " at offset " << offset;
+                    ret = -1;
+                    break;
+                }
+                record.expire_ms = get_fixed<uint64_t>(body.data() + value_offset);
+                value_offset += sizeof(uint64_t);
+            }
+        } else if (length >= INT_KEY_BODY_SIZE) {
+            record.key = skiplist::ByteKey::from_int64(get_fixed<int64_t>(body.data() + 9));
+        } else {
+            LOG(ERROR) << "Short wal record in " << file << " at offset " << offset;
+            ret = -1;
+            break;
+        }
+        record.value.clear();
+        record.value.append(body.data() + value_offset, length - value_offset);
+        if (record.sequence > from_seq) {
+            apply(record);
+        }
+        if (record.sequence > *last_seq) {
+            *last_seq = record.sequence;
+        }
+        offset += HEADER_SIZE + length;
+    }
+    ::close(fd);
+    return ret;
+}
+
+int Wal::open(uint64_t next_seq) {
+    close();
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%020" PRIu64, next_seq);
+    std::string file = _path + suffix;
+    _fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (_fd < 0) {
+        PLOG(ERROR) << "Fail to open wal segment " << file;
+        return -1;
+    }
+    _bytes = lseek(_fd, 0, SEEK_END);
+    // the entry of a new segment is not durable until its directory is,
+    // a synced record in it could vanish with the file after a crash
+    if (_bytes == 0 && skiplist::snapshot::sync_dir(file) != 0) {
+        close();
+        return -1;
+    }
+    return 0;
+}
+
+void Wal::close() {
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _buf.clear();
+}
+
+void Wal::append(uint64_t sequence, uint8_t type, const skiplist::ByteKey& key,
+        const base::IOBuf* value, uint64_t expire_ms) {
+    size_t value_size = value ? value->size() : 0;
+    size_t body_size = FIXED_BODY_SIZE + key.size() + value_size
+        + (expire_ms != 0 ? sizeof(expire_ms) : 0);
+    size_t start = _buf.size();
+    put_fixed32(&_buf, 0);
+    put_fixed32(&_buf, static_cast<uint32_t>(body_size));
+    put_fixed64(&_buf, sequence);
+    _buf.push_back(static_cast<char>(type | SIZED_KEY | (expire_ms != 0 ? HAS_EXPIRE : 0)));
+    put_fixed32(&_buf, static_cast<uint32_t>(key.size()));
+    _buf.append(key.bytes());
+    if (expire_ms != 0) {
+        put_fixed64(&_buf, expire_ms);
+    }
+    if (value) {
+        _buf.resize(_buf.size() + value_size);
+        value->copy_to(&_buf[_buf.size() - value_size], value_size);
+    }
+    uint32_t crc = base::crc32c::Value(_buf.data() + start + HEADER_SIZE, body_size);
+    memcpy(&_buf[start], &crc, sizeof(crc));
+}
+
+int Wal::flush() {
+    if (_buf.empty()) {
+        return 0;
+    }
+    if (_fd < 0 || write_full(_fd, _buf.data(), _buf.size()) != 0) {
+        PLOG(ERROR) << "Fail to write wal " << _path;
+        // cut the partial write, later records must follow a clean record
+        if (_fd >= 0 && ftruncate(_fd, _bytes) != 0) {
+            PLOG(ERROR) << "Fail to truncate wal " << _path;
+        }
+        _buf.clear();
+        return -1;
+    }
+    _bytes += _buf.size();
+    _buf.clear();
+    return 0;
+}
+
+int Wal::sync() {
+    if (_fd < 0 || fdatasync(_fd) != 0) {
+        PLOG(ERROR) << "Fail to sync wal " << _path;
+        return -1;
+    }
+    return 0;
+}
+
+int Wal::purge(uint64_t upto_seq) {
+    std::vector<std::pair<uint64_t, std::string>> segments;
+    if (list_numbered_files(_path, &segments) != 0) {
+        return -1;
+    }
+    int ret = 0;
+    // a segment ends right before the first record of the next one
+    for (size_t i = 0; i + 1 < segments.size(); ++i) {
+        if (segments[i + 1].first > upto_seq + 1) {
+            break;
+        }
+        if (unlink(segments[i].second.c_str()) != 0) {
+            PLOG(ERROR) << "Fail to remove wal segment " << segments[i].second;
+            ret = -1;
+        }
+    }
+    return ret;
+}
+}